@@ -1,5 +1,6 @@
 #include <ultra64.h>
 #include "module.h"
+#include "module_ids.h"
 #include "debug.h"
 
 //Global stack variable
@@ -15,20 +16,46 @@ static OSThread main_thread;
 static OSMesgQueue pi_msg_queue;
 static OSMesg pi_msgs[8];
 
+//Define module load completion queue
+static OSMesgQueue module_load_queue;
+static OSMesg module_load_msgs[1];
+
 static void main(void *arg)
 {
 	ModuleHandle *handle1;
 	ModuleHandle *handle2;
+	void (*counter_print)();
+	OSMesg load_msg;
 	debug_printf("Starting program\n");
 	ModuleInit();
+	//Loader thread runs whenever this thread waits
+	ModuleStartLoader(4, 5);
+	osCreateMesgQueue(&module_load_queue, module_load_msgs, 1);
 	debug_printf("Loading module1\n");
-	handle1 = ModuleLoad("module1");
+	handle1 = ModuleLoadId(MODULE_ID_MODULE1);
 	debug_printf("Loading module2\n");
-	handle2 = ModuleLoad("module2");
+	handle2 = ModuleLoadId(MODULE_ID_MODULE2);
+	debug_printf("Calling module2 function by name\n");
+	counter_print = ModuleGetSymbol(handle2, "CounterPrint");
+	if(counter_print) {
+		counter_print();
+	}
 	debug_printf("Unloading module 1\n");
 	ModuleUnload(handle1);
 	debug_printf("Unloading module 2\n");
 	ModuleUnload(handle2);
+	debug_printf("Loading module1 with its dependencies\n");
+	handle1 = ModuleLoadWithDeps(ModuleGetHandleById(MODULE_ID_MODULE1));
+	ModulePrintLoadedList();
+	debug_printf("Unloading module1 with its dependencies\n");
+	ModuleUnloadWithDeps(handle1);
+	debug_printf("Loading module2 asynchronously\n");
+	ModuleLoadAsync(ModuleGetHandleById(MODULE_ID_MODULE2), &module_load_queue);
+	osRecvMesg(&module_load_queue, &load_msg, OS_MESG_BLOCK);
+	handle2 = ModuleFinishLoad((ModuleHandle *)load_msg);
+	debug_printf("Unloading module 2\n");
+	ModuleUnload(handle2);
+	ModulePrintPrelinkStats();
 	//Intentionally cause crash
 	*(volatile int *)0xFEDCBA98 = 0;
 	while(1);
@@ -13,6 +13,24 @@
 
 #define SHN_UNDEF 0
 
+#define MODULE_RAM_ALIGN 16
+
+#define MODULE_LOADER_STACK_SIZE 0x2000
+#define MODULE_LOADER_QUEUE_SIZE 8
+
+#define MODULE_VERSION_FIXED_RELOCS 0
+#define MODULE_VERSION_COMPACT_RELOCS 1
+
+//Compact relocation head flags
+#define RELOC_TYPE_MASK 0x3
+#define RELOC_NEW_SECTION 0x4
+#define RELOC_NEW_SYM_OFS 0x8
+#define RELOC_FLAG_BITS 4
+
+//Compact self relocation head flags
+#define RELOC_SELF_BSS 0x4
+#define RELOC_SELF_FLAG_BITS 3
+
 typedef void (*ModuleFunc)();
 
 typedef struct module_section {
@@ -32,9 +50,41 @@ typedef struct reloc_entry {
 typedef struct import_module {
 	u32 module_id;
 	u32 num_relocs;
-	RelocEntry *relocs;
+	void *relocs;
 } ImportModule;
 
+typedef struct reloc_reader {
+	ImportModule *import;
+	u16 version;
+	u32 index; //Next fixed relocation entry
+	u8 *stream; //Next compact relocation byte
+	u32 run_remaining; //Compact relocations left in section run
+	u16 section; //Section being patched
+	u32 offset;
+	u8 type;
+	u16 sym_section;
+	u32 sym_ofs;
+	s32 addend; //Compact HI16 addend including paired lo
+} RelocReader;
+
+typedef struct import_link {
+	struct import_link *next;
+	struct import_link *prev;
+	ModuleHandle *importer;
+	ImportModule *import;
+} ImportLink;
+
+typedef struct module_range {
+	u32 start;
+	u32 end;
+	ModuleHandle *handle;
+} ModuleRange;
+
+typedef struct flush_range {
+	u32 start;
+	u32 end;
+} FlushRange;
+
 typedef struct module_header {
 	u32 num_sections;
 	ModuleSection *section_info;
@@ -45,27 +95,76 @@ typedef struct module_header {
 	u16 prolog_section;
 	u16 epilog_section;
 	u16 unresolved_section;
-	u16 pad;
+	u16 version;
 	ModuleFunc prolog;
 	ModuleFunc epilog;
 	ModuleFunc unresolved;
 } ModuleHeader;
 
+typedef struct module_export {
+	u32 hash;
+	u32 name_ofs; //From start of export table, 0 for empty slots
+	u32 offset;
+	u16 section;
+	u16 module_id; //0 for the exporting module
+} ModuleExport;
+
+typedef struct module_export_table {
+	u32 num_slots; //Power of 2
+	u32 num_exports;
+	ModuleExport slots[];
+} ModuleExportTable;
+
+typedef struct module_name_slot {
+	u32 hash;
+	u32 module_id; //0 for empty slots
+} ModuleNameSlot;
+
+typedef struct module_name_table {
+	u32 num_slots; //Power of 2
+	ModuleNameSlot slots[];
+} ModuleNameTable;
+
 struct module_handle {
 	char *name;
 	u32 module_align;
 	u32 module_size;
 	u32 rom_ofs;
+	u32 rom_size; //Smaller than module_size when compressed
 	u32 noload_align;
 	u32 noload_size;
+	u32 shared_module; //ID of module holding shared sections, 0 if none
+	u32 export_ofs;
+	u32 export_size; //0 if module exports nothing
+	u32 prelink_addr; //Address self relocations were applied for, 0 if not prelinked
+	u16 *deps; //IDs of modules this module imports from
+	u32 num_deps;
 	u32 ref_count;
 	ModuleHeader *module;
+	ModuleExportTable *exports; //Read on first symbol lookup
+	ImportLink *importers; //Loaded modules importing from this module
+	ImportLink *import_links; //One per entry of module->import_modules while loaded
+	ModuleHeader *load_module; //Read by the loader thread until ModuleFinishLoad
+	OSMesgQueue *load_queue; //Receives the handle when an asynchronous load is ready
 };
 
 extern u8 __module_romdata[];
 
 static u32 num_modules;
 static ModuleHandle *module_handle_data;
+static ModuleNameTable *module_names; //Stored right after the handles
+static ModuleRange *loaded_ranges; //Sorted by start address
+static u32 num_loaded_ranges;
+static u8 *dep_visited; //Dependency walk scratch allocated once so it never shifts module addresses
+static u16 *dep_order;
+static bool dep_scratch_used;
+static OSThread loader_thread;
+static u8 loader_stack[MODULE_LOADER_STACK_SIZE] __attribute__((aligned(8)));
+static OSMesgQueue loader_queue;
+static OSMesg loader_msgs[MODULE_LOADER_QUEUE_SIZE];
+static bool loader_started;
+static u32 prelink_loads;
+static u32 prelink_hits;
 
 static inline u32 AlignValue(u32 value, u32 alignment)
 {
@@ -81,9 +180,16 @@ static void FixupModuleHandles()
 {
 	for(u32 i=0; i<num_modules; i++) {
 		module_handle_data[i].name += (u32)module_handle_data;
+		module_handle_data[i].deps = (u16 *)((u32)module_handle_data+(u32)module_handle_data[i].deps);
 		module_handle_data[i].rom_ofs += (u32)__module_romdata+8;
+		module_handle_data[i].export_ofs += (u32)__module_romdata+8;
 		module_handle_data[i].ref_count = 0;
 		module_handle_data[i].module = NULL;
+		module_handle_data[i].exports = NULL;
+		module_handle_data[i].importers = NULL;
+		module_handle_data[i].import_links = NULL;
+		module_handle_data[i].load_module = NULL;
+		module_handle_data[i].load_queue = NULL;
 	}
 }
 
@@ -100,13 +206,24 @@ void ModuleInit()
 		debug_assert(module_handle_data != NULL);
 		RomRead(module_handle_data, (u32)__module_romdata+8, read_size);
 		FixupModuleHandles();
+		module_names = (ModuleNameTable *)&module_handle_data[num_modules];
+	}
+	if(num_modules != 0) {
+		loaded_ranges = malloc(num_modules*sizeof(ModuleRange));
+		debug_assert(loaded_ranges != NULL);
+		dep_visited = malloc(num_modules);
+		dep_order = malloc(num_modules*sizeof(u16));
+		debug_assert(dep_visited != NULL && dep_order != NULL);
 	}
 }
 
 static u32 GetModuleRamAlign(ModuleHandle *handle)
 {
-	//Return bigger of module_align and noload_align
-	u32 align_val = handle->module_align;
+	//Return biggest of cache line size, module_align and noload_align
+	u32 align_val = MODULE_RAM_ALIGN;
+	if(align_val < handle->module_align) {
+		align_val = handle->module_align;
+	}
 	if(align_val < handle->noload_align) {
 		align_val = handle->noload_align;
 	}
@@ -118,27 +235,115 @@ static u32 GetModuleRamSize(ModuleHandle *handle)
 	return AlignValue(handle->module_size, handle->noload_align)+handle->noload_size;
 }
 
-static void *GetModuleBssPtr(ModuleHandle *handle)
+static void *GetModuleBssPtr(ModuleHandle *handle, ModuleHeader *module)
 {
 	//Placed immediately after end of ROM data aligned to handle->noload_align
-	u32 base = (u32)handle->module;
+	u32 base = (u32)module;
 	u32 ofs = AlignValue(handle->module_size, handle->noload_align);
 	return (void *)(base+ofs);
 }
 
+static u32 HashName(char *name)
+{
+	//32-bit FNV-1a, must match makemodule
+	u32 hash = 0x811C9DC5;
+	while(*name) {
+		hash ^= (u8)*name++;
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
+static u32 FindRangeIndex(u32 addr)
+{
+	//Binary search for first range starting after addr
+	u32 low = 0;
+	u32 high = num_loaded_ranges;
+	while(low < high) {
+		u32 mid = (low+high)/2;
+		if(loaded_ranges[mid].start <= addr) {
+			low = mid+1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+static void AddLoadedRange(ModuleHandle *handle)
+{
+	u32 start = (u32)handle->module;
+	//Disable interrupts so lookups from interrupt handlers never see a partial update
+	OSIntMask prev_mask = osSetIntMask(OS_IM_NONE);
+	u32 index = FindRangeIndex(start);
+	for(u32 i=num_loaded_ranges; i>index; i--) {
+		loaded_ranges[i] = loaded_ranges[i-1];
+	}
+	loaded_ranges[index].start = start;
+	loaded_ranges[index].end = start+GetModuleRamSize(handle);
+	loaded_ranges[index].handle = handle;
+	num_loaded_ranges++;
+	osSetIntMask(prev_mask);
+}
+
+static void RemoveLoadedRange(ModuleHandle *handle)
+{
+	//Disable interrupts so lookups from interrupt handlers never see a partial update
+	OSIntMask prev_mask = osSetIntMask(OS_IM_NONE);
+	//Ranges never overlap so the range containing the start is this module's
+	u32 index = FindRangeIndex((u32)handle->module)-1;
+	num_loaded_ranges--;
+	for(u32 i=index; i<num_loaded_ranges; i++) {
+		loaded_ranges[i] = loaded_ranges[i+1];
+	}
+	osSetIntMask(prev_mask);
+}
+
 ModuleHandle *ModuleFind(char *name)
 {
-	//Search through module names
-	for(u32 i=0; i<num_modules; i++) {
-		if(!strcmp(name, module_handle_data[i].name)) {
-			//Found module name
-			return &module_handle_data[i];
+	if(!module_names) {
+		return NULL;
+	}
+	u32 hash = HashName(name);
+	u32 mask = module_names->num_slots-1;
+	//Probe until the name or an empty slot is found
+	for(u32 i=hash & mask; module_names->slots[i].module_id != 0; i=(i+1) & mask) {
+		if(module_names->slots[i].hash == hash) {
+			ModuleHandle *handle = &module_handle_data[module_names->slots[i].module_id-1];
+			if(!strcmp(name, handle->name)) {
+				//Found module name
+				return handle;
+			}
 		}
 	}
 	//Couldn't find module name
 	return NULL;
 }
 
+ModuleHandle *ModuleGetHandleById(u32 id)
+{
+	//IDs come from the makemodule generated module_ids.h and start at 1 like import module IDs
+	if(id == 0 || id > num_modules) {
+		return NULL;
+	}
+	return &module_handle_data[id-1];
+}
+
+static ModuleSection *GetSection(ModuleHeader *module, u16 index)
+{
+	if(module->version == MODULE_VERSION_COMPACT_RELOCS) {
+		//Compact section tables have no NULL section
+		if(index == SHN_UNDEF || index > module->num_sections) {
+			return NULL;
+		}
+		return &module->section_info[index-1];
+	}
+	if(index >= module->num_sections) {
+		return NULL;
+	}
+	return &module->section_info[index];
+}
+
 static void PatchModuleSections(ModuleHeader *module, void *bss)
 {
 	u8 *bss_ptr = bss;
@@ -167,37 +372,152 @@ static void PatchModuleImports(ModuleHeader *module)
 	for(u32 i=0; i<module->num_import_modules; i++) {
 		ImportModule *import = &module->import_modules[i];
 		//Patch import module relocation pointer
-		import->relocs = (RelocEntry *)((u32)module+(u32)import->relocs);
+		import->relocs = (void *)((u32)module+(u32)import->relocs);
 	}
 }
 
 static void *GetSectionPtr(ModuleHeader *module, u16 index, u32 offset)
 {
-	if(module && index < module->num_sections) {
+	ModuleSection *section = NULL;
+	if(module) {
+		section = GetSection(module, index);
+	}
+	if(section) {
 		//Indexing into valid section
-		return (char *)module->section_info[index].ptr+offset;
+		return (char *)section->ptr+offset;
 	} else {
 		//Indexing into invalid section
 		return (void *)offset;
 	}
 }
 
-static void FlushSection(ModuleHeader *module, u16 section)
+static void InitFlushRange(FlushRange *range)
 {
-	//Skip invalid sections
-	if(section >= module->num_sections) {
-		return;
+	range->start = 0xFFFFFFFF;
+	range->end = 0;
+}
+
+static void ExtendFlushRange(FlushRange *range, u32 *reloc_ptr)
+{
+	//Relocations are sorted by section and offset so this mostly just moves the end
+	if((u32)reloc_ptr < range->start) {
+		range->start = (u32)reloc_ptr;
+	}
+	if((u32)(reloc_ptr+1) > range->end) {
+		range->end = (u32)(reloc_ptr+1);
+	}
+}
+
+static void FlushPatchedRange(FlushRange *range)
+{
+	//Flush everything patched by a link pass at once
+	if(range->start < range->end) {
+		osWritebackDCache((void *)range->start, range->end-range->start);
+		osInvalICache((void *)range->start, range->end-range->start);
+	}
+	InitFlushRange(range);
+}
+
+static u32 ReadULEB(u8 **stream)
+{
+	u8 *ptr = *stream;
+	u32 value = 0;
+	u32 shift = 0;
+	u8 byte;
+	//Read 7 bits at a time until continuation bit is clear
+	do {
+		byte = *ptr++;
+		value |= (u32)(byte & 0x7F) << shift;
+		shift += 7;
+	} while(byte & 0x80);
+	*stream = ptr;
+	return value;
+}
+
+static s32 DecodeZigZag(u32 value)
+{
+	return (s32)(value >> 1) ^ -(s32)(value & 0x1);
+}
+
+static s32 ReadZigZag(u8 **stream)
+{
+	return DecodeZigZag(ReadULEB(stream));
+}
+
+static void InitRelocReader(RelocReader *reader, ModuleHeader *module, ImportModule *import)
+{
+	reader->import = import;
+	reader->version = module->version;
+	reader->index = 0;
+	reader->stream = import->relocs;
+	reader->run_remaining = 0;
+	reader->section = SHN_UNDEF;
+	reader->offset = 0;
+	reader->type = 0;
+	reader->sym_section = SHN_UNDEF;
+	reader->sym_ofs = 0;
+	reader->addend = 0;
+}
+
+static bool ReadFixedReloc(RelocReader *reader)
+{
+	RelocEntry *relocs = reader->import->relocs;
+	while(reader->index < reader->import->num_relocs) {
+		RelocEntry *reloc = &relocs[reader->index++];
+		if(reloc->type == R_ULTRA_SEC) {
+			//Change section
+			reader->section = reloc->section;
+			continue;
+		}
+		reader->offset = reloc->offset;
+		reader->type = reloc->type;
+		reader->sym_section = reloc->section;
+		reader->sym_ofs = reloc->sym_ofs;
+		return true;
+	}
+	return false;
+}
+
+static bool ReadCompactReloc(RelocReader *reader)
+{
+	static const u8 reloc_types[] = { R_MIPS_32, R_MIPS_26, R_MIPS_HI16, R_MIPS_LO16 };
+	u32 head;
+	if(reader->run_remaining == 0) {
+		//Start next section run
+		if(reader->index >= reader->import->num_relocs) {
+			return false;
+		}
+		reader->section = ReadULEB(&reader->stream);
+		reader->run_remaining = ReadULEB(&reader->stream);
+		reader->offset = 0;
+	}
+	head = ReadULEB(&reader->stream);
+	reader->offset += DecodeZigZag(head >> RELOC_FLAG_BITS) << 2;
+	reader->type = reloc_types[head & RELOC_TYPE_MASK];
+	if(head & RELOC_NEW_SECTION) {
+		reader->sym_section = ReadULEB(&reader->stream);
 	}
-	void *section_ptr = module->section_info[section].ptr;
-	u32 section_size = module->section_info[section].size;
-	//Flush only sections with at least some data
-	if(section_ptr && section_size) {
-		osWritebackDCache(section_ptr, section_size);
-		osInvalICache(section_ptr, section_size);
+	if(head & RELOC_NEW_SYM_OFS) {
+		reader->sym_ofs += ReadZigZag(&reader->stream);
 	}
+	if(reader->type == R_MIPS_HI16) {
+		reader->addend = ReadZigZag(&reader->stream);
+	}
+	reader->run_remaining--;
+	reader->index++;
+	return true;
 }
 
-static void ApplyModuleImportRelocs(ModuleHeader *module, ImportModule *import)
+static bool ReadReloc(RelocReader *reader)
+{
+	if(reader->version == MODULE_VERSION_COMPACT_RELOCS) {
+		return ReadCompactReloc(reader);
+	} else {
+		return ReadFixedReloc(reader);
+	}
+}
+
+static void ApplyModuleImportRelocs(ModuleHeader *module, ImportModule *import, FlushRange *flush)
 {
 	ModuleHeader *src_module = NULL;
 	//Get module pointer
@@ -206,15 +526,16 @@ static void ApplyModuleImportRelocs(ModuleHeader *module, ImportModule *import)
 	}
 	if(import->module_id == 0 || src_module) {
 		//Module loaded or static module
-		u16 cur_section = SHN_UNDEF; //Save section for getting relocation pointer
-		for(u32 i=0; i<import->num_relocs; i++) {
-			RelocEntry *reloc = &import->relocs[i];
-			u32 *reloc_ptr = GetSectionPtr(module, cur_section, reloc->offset);
-			switch(reloc->type) {
+		RelocReader reader;
+		InitRelocReader(&reader, module, import);
+		while(ReadReloc(&reader)) {
+			u32 *reloc_ptr = GetSectionPtr(module, reader.section, reader.offset);
+			ExtendFlushRange(flush, reloc_ptr);
+			switch(reader.type) {
 				case R_MIPS_32:
 				//Direct 32-bit pointer relocations
 				{
-					u32 sym_ptr = (u32)GetSectionPtr(src_module, reloc->section, reloc->sym_ofs);
+					u32 sym_ptr = (u32)GetSectionPtr(src_module, reader.sym_section, reader.sym_ofs);
 					*reloc_ptr += sym_ptr;
 				}
 					break;
@@ -223,7 +544,7 @@ static void ApplyModuleImportRelocs(ModuleHeader *module, ImportModule *import)
 				//26-bit relative pointer relocations
 				//Used for Jumps
 				{
-					u32 sym_ptr = (u32)GetSectionPtr(src_module, reloc->section, reloc->sym_ofs);
+					u32 sym_ptr = (u32)GetSectionPtr(src_module, reader.sym_section, reader.sym_ofs);
 					//Extract original target from instruction and address
 					u32 target = ((*reloc_ptr & 0x3FFFFFF) << 2)|((u32)reloc_ptr & 0xF0000000);
 					//Hack for unresolved functions
@@ -241,20 +562,26 @@ static void ApplyModuleImportRelocs(ModuleHeader *module, ImportModule *import)
 					u16 hi_orig = *reloc_ptr & 0xFFFF;
 					u32 addr = hi_orig << 16;
 					u16 hi = hi_orig;
-					//Calculate real hi using next lo
-					for(u32 j=i+1; j<import->num_relocs; j++) {
-						RelocEntry *new_reloc = &import->relocs[j];
-						if(new_reloc->type == R_MIPS_LO16) {
-							//Found lo
-							u32 sym_ptr = (u32)GetSectionPtr(src_module, new_reloc->section, new_reloc->sym_ofs);
-							u32 *lo_ptr = GetSectionPtr(module, cur_section, new_reloc->offset);
-							u16 lo = *lo_ptr & 0xFFFF;
-							//Calculate effective address with lo and symbol pointer
-							addr += lo-((lo & 0x8000) << 1);
-							addr += sym_ptr;
-							//Calculate hi from effective address
-							hi = (addr >> 16)+((addr & 0x8000) >> 15);
-							break;
+					if(reader.version == MODULE_VERSION_COMPACT_RELOCS) {
+						//Addend already includes paired lo
+						addr = reader.addend+(u32)GetSectionPtr(src_module, reader.sym_section, reader.sym_ofs);
+						hi = (addr >> 16)+((addr & 0x8000) >> 15);
+					} else {
+						RelocReader lo_reader = reader;
+						//Calculate real hi using next lo
+						while(ReadReloc(&lo_reader)) {
+							if(lo_reader.type == R_MIPS_LO16) {
+								//Found lo
+								u32 sym_ptr = (u32)GetSectionPtr(src_module, lo_reader.sym_section, lo_reader.sym_ofs);
+								u32 *lo_ptr = GetSectionPtr(module, lo_reader.section, lo_reader.offset);
+								u16 lo = *lo_ptr & 0xFFFF;
+								//Calculate effective address with lo and symbol pointer
+								addr += lo-((lo & 0x8000) << 1);
+								addr += sym_ptr;
+								//Calculate hi from effective address
+								hi = (addr >> 16)+((addr & 0x8000) >> 15);
+								break;
+							}
 						}
 					}
 					//Write hi
@@ -264,34 +591,26 @@ static void ApplyModuleImportRelocs(ModuleHeader *module, ImportModule *import)
 					
 				case R_MIPS_LO16:
 				{
-					u32 sym_ptr = (u32)GetSectionPtr(src_module, reloc->section, reloc->sym_ofs);
+					u32 sym_ptr = (u32)GetSectionPtr(src_module, reader.sym_section, reader.sym_ofs);
 					u16 lo = *reloc_ptr & 0xFFFF;
 					lo += sym_ptr;
 					*reloc_ptr = (*reloc_ptr & 0xFFFF0000)|lo;
 				}
 					break;
 					
-				case R_ULTRA_SEC:
-					//Flush cache of previous section
-					FlushSection(module, cur_section);
-					//Change section
-					cur_section = reloc->section;
-					break;
-					
 				default:
-					debug_printf("Unknown relocation type %d.\n", reloc->type);
+					debug_printf("Unknown relocation type %d.\n", reader.type);
 					break;
 			}
 		}
-		//Flush cache of last section
-		FlushSection(module, cur_section);
 	} else if(!src_module) {
 		//Module not loaded
-		u16 cur_section = SHN_UNDEF; //Save section for getting relocation pointer
-		for(u32 i=0; i<import->num_relocs; i++) {
-			RelocEntry *reloc = &import->relocs[i];
-			u32 *reloc_ptr = GetSectionPtr(module, cur_section, reloc->offset);
-			switch(reloc->type) {
+		RelocReader reader;
+		InitRelocReader(&reader, module, import);
+		while(ReadReloc(&reader)) {
+			u32 *reloc_ptr = GetSectionPtr(module, reader.section, reader.offset);
+			ExtendFlushRange(flush, reloc_ptr);
+			switch(reader.type) {
 				case R_MIPS_32:
 					break;
 					
@@ -315,69 +634,197 @@ static void ApplyModuleImportRelocs(ModuleHeader *module, ImportModule *import)
 				case R_MIPS_LO16:
 					break;
 					
-				case R_ULTRA_SEC:
-					//Flush cache of previous section
-					FlushSection(module, cur_section);
-					//Change section
-					cur_section = reloc->section;
-					break;
-					
 				default:
-					debug_printf("Unknown relocation type %d.\n", reloc->type);
+					debug_printf("Unknown relocation type %d.\n", reader.type);
 					break;
 			}
 		}
-		//Flush cache of last section
-		FlushSection(module, cur_section);
 	}
 }
 
-static void ApplyRelocs(ModuleHeader *module)
+static u32 GetModuleID(ModuleHandle *handle)
 {
-	//Apply Import relocations for all import modules
-	for(u32 i=0; i<module->num_import_modules; i++) {
-		ApplyModuleImportRelocs(module, &module->import_modules[i]);
-	}
+	return (handle-module_handle_data)+1;
 }
 
-static u32 GetModuleID(ModuleHeader *module)
+static bool IsLinkedImport(ModuleHandle *handle, ImportModule *import)
 {
-	//Search for module pointer in module handles
-	for(u32 i=0; i<num_modules; i++) {
-		if(module_handle_data[i].module == module) {
-			return i+1;
+	//Main executable and self relocations never change after loading
+	return import->module_id != 0 && import->module_id != GetModuleID(handle);
+}
+
+static void AddImportLinks(ModuleHandle *handle)
+{
+	ModuleHeader *module = handle->module;
+	if(module->num_import_modules == 0) {
+		return;
+	}
+	handle->import_links = malloc(module->num_import_modules*sizeof(ImportLink));
+	debug_assert(handle->import_links);
+	//Register this module with every module it imports from
+	for(u32 i=0; i<module->num_import_modules; i++) {
+		ImportLink *link = &handle->import_links[i];
+		link->importer = handle;
+		link->import = &module->import_modules[i];
+		if(IsLinkedImport(handle, link->import)) {
+			ModuleHandle *target = &module_handle_data[link->import->module_id-1];
+			link->prev = NULL;
+			link->next = target->importers;
+			if(target->importers) {
+				target->importers->prev = link;
+			}
+			target->importers = link;
 		}
 	}
-	return 0;
 }
 
-static void FixupExternalModuleReferences(ModuleHeader *module)
+static void RemoveImportLinks(ModuleHandle *handle)
 {
-	u32 module_id = GetModuleID(module);
-	//Check for invalid module ID
-	if(module_id == 0) {
+	ModuleHeader *module = handle->module;
+	if(!handle->import_links) {
 		return;
 	}
-	//Loop through all modules
-	for(u32 i=0; i<num_modules; i++) {
-		//Skip this module
-		if(i+1 != module_id) {
-			//Check for loaded module
-			ModuleHeader *module2 = module_handle_data[i].module;
-			if(!module2) {
-				continue;
+	for(u32 i=0; i<module->num_import_modules; i++) {
+		ImportLink *link = &handle->import_links[i];
+		if(IsLinkedImport(handle, link->import)) {
+			ModuleHandle *target = &module_handle_data[link->import->module_id-1];
+			if(link->prev) {
+				link->prev->next = link->next;
+			} else {
+				target->importers = link->next;
 			}
-			//Apply import relocations applying to module module_id
-			for(u32 j=0; j<module2->num_import_modules; j++) {
-				if(module2->import_modules[j].module_id == module_id) { 
-					ApplyModuleImportRelocs(module2, &module2->import_modules[j]);
+			if(link->next) {
+				link->next->prev = link->prev;
+			}
+		}
+	}
+	free(handle->import_links);
+	handle->import_links = NULL;
+}
+
+static void ApplySelfRelocs(ModuleHeader *module, ImportModule *import, void *bss, u32 prelink_addr, FlushRange *flush)
+{
+	u8 *stream = import->relocs;
+	u16 section;
+	//Targets are pre-offset so only the module or BSS base is added
+	u32 bases[2] = { (u32)module, (u32)bss };
+	u32 deltas[2] = { (u32)module, (u32)bss };
+	if(prelink_addr != 0) {
+		//Prelinked targets already hold the preferred base so only the distance moved is added
+		deltas[0] = (u32)module-prelink_addr;
+		deltas[1] = deltas[0];
+	}
+	while((section = ReadULEB(&stream)) != SHN_UNDEF) {
+		u32 num_relocs = ReadULEB(&stream);
+		u32 *reloc_ptr = GetSectionPtr(module, section, 0);
+		for(u32 i=0; i<num_relocs; i++) {
+			u32 head = ReadULEB(&stream);
+			u32 base = bases[(head & RELOC_SELF_BSS) != 0];
+			u32 delta = deltas[(head & RELOC_SELF_BSS) != 0];
+			reloc_ptr += DecodeZigZag(head >> RELOC_SELF_FLAG_BITS);
+			ExtendFlushRange(flush, reloc_ptr);
+			switch(head & RELOC_TYPE_MASK) {
+				case 0:
+				//R_MIPS_32
+					*reloc_ptr += delta;
 					break;
+					
+				case 1:
+				//R_MIPS_26
+				{
+					u32 target = ((*reloc_ptr & 0x3FFFFFF) << 2)+delta;
+					*reloc_ptr = (*reloc_ptr & 0xFC000000)|((target & 0xFFFFFFC) >> 2);
 				}
+					break;
+					
+				case 2:
+				//R_MIPS_HI16
+				{
+					u32 addr = ReadZigZag(&stream)+base;
+					u16 hi = (addr >> 16)+((addr & 0x8000) >> 15);
+					*reloc_ptr = (*reloc_ptr & 0xFFFF0000)|hi;
+				}
+					break;
+					
+				case 3:
+				//R_MIPS_LO16
+				{
+					u16 lo = *reloc_ptr & 0xFFFF;
+					lo += delta;
+					*reloc_ptr = (*reloc_ptr & 0xFFFF0000)|lo;
+				}
+					break;
+			}
+		}
+	}
+}
+
+static bool IsStaticImport(ModuleHandle *handle, ModuleHeader *module, ImportModule *import)
+{
+	//Main executable and compact self relocations never look at other modules
+	if(import->module_id == 0) {
+		return true;
+	}
+	return module->version == MODULE_VERSION_COMPACT_RELOCS && import->module_id == GetModuleID(handle);
+}
+
+static void ApplyImportRelocs(ModuleHandle *handle, ModuleHeader *module, bool static_imports, FlushRange *flush)
+{
+	void *bss = GetModuleBssPtr(handle, module);
+	u32 module_id = GetModuleID(handle);
+	//Apply Import relocations for all import modules of the requested kind
+	for(u32 i=0; i<module->num_import_modules; i++) {
+		ImportModule *import = &module->import_modules[i];
+		if(IsStaticImport(handle, module, import) != static_imports) {
+			continue;
+		}
+		if(module->version == MODULE_VERSION_COMPACT_RELOCS && import->module_id == module_id) {
+			//Prelinked modules at their preferred address are already relocated
+			if((u32)module != handle->prelink_addr) {
+				ApplySelfRelocs(module, import, bss, handle->prelink_addr, flush);
 			}
+		} else {
+			ApplyModuleImportRelocs(module, import, flush);
+		}
+	}
+}
+
+static void InitImageFlushRange(FlushRange *flush, ModuleHandle *handle, ModuleHeader *module)
+{
+	//Cover the whole loaded image since freshly read code may be stale in the instruction cache
+	flush->start = (u32)module;
+	flush->end = (u32)GetModuleBssPtr(handle, module);
+}
+
+static void ApplyRelocs(ModuleHandle *handle)
+{
+	FlushRange flush;
+	InitImageFlushRange(&flush, handle, handle->module);
+	ApplyImportRelocs(handle, handle->module, true, &flush);
+	ApplyImportRelocs(handle, handle->module, false, &flush);
+	FlushPatchedRange(&flush);
+}
+
+static void FixupExternalModuleReferences(ModuleHandle *handle, u8 *linked)
+{
+	//Only loaded modules importing from this module are visited
+	for(ImportLink *link=handle->importers; link; link=link->next) {
+		FlushRange flush;
+		//Skip modules already linked against this module
+		if(linked && linked[GetModuleID(link->importer)-1]) {
+			continue;
 		}
+		InitFlushRange(&flush);
+		ApplyModuleImportRelocs(link->importer->module, link->import, &flush);
+		FlushPatchedRange(&flush);
 	}
 }
 
+void ModulePrintPrelinkStats()
+{
+	debug_printf("Prelinked modules loaded at preferred address: %d of %d\n", prelink_hits, prelink_loads);
+}
+
 void ModulePrintLoadedList()
 {
 	u32 num_loaded = 0;
@@ -407,7 +854,7 @@ static void DefaultUnresolvedHandler()
 	while(1);
 }
 
-static void LinkModule(ModuleHeader *module, void *bss)
+static void PrepareModule(ModuleHeader *module, void *bss)
 {
 	//Fixup header pointers
 	PatchModuleSections(module, bss);
@@ -428,9 +875,15 @@ static void LinkModule(ModuleHeader *module, void *bss)
 	} else {
 		module->unresolved = DefaultUnresolvedHandler;
 	}
+}
+
+static void LinkModule(ModuleHandle *handle)
+{
+	PrepareModule(handle->module, GetModuleBssPtr(handle, handle->module));
+	AddImportLinks(handle);
 	//Relocate
-	ApplyRelocs(module);
-	FixupExternalModuleReferences(module);
+	ApplyRelocs(handle);
+	FixupExternalModuleReferences(handle, NULL);
 }
 
 bool ModuleIsLoaded(ModuleHandle *handle)
@@ -443,8 +896,9 @@ static void RunCtors(ModuleHeader *module)
 	if(module->ctor_section == SHN_UNDEF) {
 		return;
 	}
-	ModuleFunc *start = module->section_info[module->ctor_section].ptr;
-	ModuleFunc *end = start+(module->section_info[module->ctor_section].size/sizeof(ModuleFunc));
+	ModuleSection *section = GetSection(module, module->ctor_section);
+	ModuleFunc *start = section->ptr;
+	ModuleFunc *end = start+(section->size/sizeof(ModuleFunc));
 	ModuleFunc *curr = start;
 	while(curr < end) {
 		(*curr)();
@@ -452,28 +906,67 @@ static void RunCtors(ModuleHeader *module)
 	}
 }
 
+static ModuleHeader *AllocModule(ModuleHandle *handle)
+{
+	//Cache line alignment lets RomRead DMA directly with invalidate only
+	ModuleHeader *module = memalign(GetModuleRamAlign(handle), GetModuleRamSize(handle));
+	debug_assert(module);
+	return module;
+}
+
+static void ReadModuleData(ModuleHandle *handle, ModuleHeader *module)
+{
+	memset(module, 0, GetModuleRamSize(handle)); //Zero out module memory
+	//Read Module
+	if(handle->rom_size < handle->module_size) {
+		RomReadCompressed(module, handle->module_size, handle->rom_ofs, handle->rom_size);
+	} else {
+		RomRead(module, handle->rom_ofs, handle->module_size);
+	}
+}
+
+static void PublishModule(ModuleHandle *handle, ModuleHeader *module)
+{
+	handle->module = module;
+	AddLoadedRange(handle);
+	//Only lands on the preferred address when heap usage repeats the saved run, ModulePrintPrelinkStats reports misses
+	if(handle->prelink_addr != 0) {
+		prelink_loads++;
+		if((u32)handle->module == handle->prelink_addr) {
+			prelink_hits++;
+		}
+	}
+}
+
+static void ReadModule(ModuleHandle *handle)
+{
+	ModuleHeader *module = AllocModule(handle);
+	ReadModuleData(handle, module);
+	PublishModule(handle, module);
+}
+
+static void StartModule(ModuleHandle *handle)
+{
+	//Run Constructors
+	RunCtors(handle->module);
+	//Run module prolog
+	if(handle->module->prolog) {
+		handle->module->prolog();
+	}
+}
+
 ModuleHandle *ModuleLoadHandle(ModuleHandle *handle)
 {
 	debug_assert(handle);
 	if(!handle->module) {
-		//Load module
-		u32 module_align = GetModuleRamAlign(handle);
-		if(module_align <= 8) {
-			//Malloc guarantees 8-byte alignment on this platform
-			handle->module = malloc(GetModuleRamSize(handle));
-		} else {
-			handle->module = memalign(module_align, GetModuleRamSize(handle));
-		}
-		debug_assert(handle->module);
-		memset(handle->module, 0, GetModuleRamSize(handle)); //Zero out module memory
-		RomRead(handle->module, handle->rom_ofs, handle->module_size); //Read Module
-		LinkModule(handle->module, GetModuleBssPtr(handle));
-		//Run Constructors
-		RunCtors(handle->module);
-		//Run module prolog
-		if(handle->module->prolog) {
-			handle->module->prolog();
+		//Shared sections must be resident before linking against them
+		if(handle->shared_module != 0) {
+			ModuleLoadHandle(&module_handle_data[handle->shared_module-1]);
 		}
+		//Load module
+		ReadModule(handle);
+		LinkModule(handle);
+		StartModule(handle);
 		//Initialize reference count
 		handle->ref_count = 1;
 	} else {
@@ -494,7 +987,185 @@ ModuleHandle *ModuleLoad(char *name)
 	return ModuleLoadHandle(handle);
 }
 
-static void UndoModuleImportRelocs(ModuleHeader *module, ImportModule *import)
+ModuleHandle *ModuleLoadId(u32 id)
+{
+	ModuleHandle *handle = ModuleGetHandleById(id);
+	if(!handle) {
+		//Invalid module ID
+		return NULL;
+	}
+	return ModuleLoadHandle(handle);
+}
+
+static void ModuleLoaderThread(void *arg)
+{
+	while(1) {
+		ModuleHandle *handle;
+		FlushRange flush;
+		osRecvMesg(&loader_queue, (OSMesg *)&handle, OS_MESG_BLOCK);
+		ModuleHeader *module = handle->load_module;
+		ReadModuleData(handle, module);
+		PrepareModule(module, GetModuleBssPtr(handle, module));
+		//Other modules may load or unload meanwhile so only relocations not involving them are applied here
+		InitImageFlushRange(&flush, handle, module);
+		ApplyImportRelocs(handle, module, true, &flush);
+		FlushPatchedRange(&flush);
+		osSendMesg(handle->load_queue, (OSMesg)handle, OS_MESG_BLOCK);
+	}
+}
+
+void ModuleStartLoader(OSId id, OSPri priority)
+{
+	if(loader_started) {
+		//Only change priority of existing loader thread
+		osSetThreadPri(&loader_thread, priority);
+		return;
+	}
+	osCreateMesgQueue(&loader_queue, loader_msgs, MODULE_LOADER_QUEUE_SIZE);
+	//Caller picks the thread ID so it never clashes with the game's own threads
+	osCreateThread(&loader_thread, id, ModuleLoaderThread, NULL, &loader_stack[MODULE_LOADER_STACK_SIZE], priority);
+	osStartThread(&loader_thread);
+	loader_started = true;
+}
+
+void ModuleLoadAsync(ModuleHandle *handle, OSMesgQueue *done)
+{
+	debug_assert(handle && done && loader_started);
+	debug_assert(!handle->load_queue); //One request per module at a time
+	handle->load_queue = done;
+	if(handle->module) {
+		//Already loaded so ModuleFinishLoad only adds a reference
+		handle->load_module = NULL;
+		osSendMesg(done, (OSMesg)handle, OS_MESG_BLOCK);
+		return;
+	}
+	//Allocate on this thread since malloc is not thread safe
+	handle->load_module = AllocModule(handle);
+	osSendMesg(&loader_queue, (OSMesg)handle, OS_MESG_BLOCK);
+}
+
+ModuleHandle *ModuleFinishLoad(ModuleHandle *handle)
+{
+	debug_assert(handle && handle->load_queue);
+	ModuleHeader *module = handle->load_module;
+	FlushRange flush;
+	handle->load_queue = NULL;
+	handle->load_module = NULL;
+	if(!module || handle->module) {
+		//Loaded before the request finished
+		if(module) {
+			free(module);
+		}
+		return ModuleLoadHandle(handle);
+	}
+	//Shared sections must be resident before linking against them
+	if(handle->shared_module != 0) {
+		ModuleLoadHandle(&module_handle_data[handle->shared_module-1]);
+	}
+	PublishModule(handle, module);
+	AddImportLinks(handle);
+	//Link against modules loaded right now
+	InitFlushRange(&flush);
+	ApplyImportRelocs(handle, module, false, &flush);
+	FlushPatchedRange(&flush);
+	FixupExternalModuleReferences(handle, NULL);
+	//Constructors and prolog run on the requesting thread
+	StartModule(handle);
+	handle->ref_count = 1;
+	return handle;
+}
+
+static u32 CollectModuleDeps(u32 module_id, u8 *visited, u16 *order, u32 num_order)
+{
+	ModuleHandle *handle = &module_handle_data[module_id-1];
+	visited[module_id-1] = 1;
+	//Dependencies come before the modules importing them, cycles are broken at the first revisit
+	for(u32 i=0; i<handle->num_deps; i++) {
+		if(!visited[handle->deps[i]-1]) {
+			num_order = CollectModuleDeps(handle->deps[i], visited, order, num_order);
+		}
+	}
+	order[num_order++] = module_id;
+	return num_order;
+}
+
+static void AcquireDepScratch(u8 **visited, u16 **order)
+{
+	if(!dep_scratch_used) {
+		dep_scratch_used = true;
+		*visited = dep_visited;
+		*order = dep_order;
+		return;
+	}
+	//Constructors and destructors may load or unload more modules while the scratch is in use
+	*visited = malloc(num_modules);
+	*order = malloc(num_modules*sizeof(u16));
+	debug_assert(*visited && *order);
+}
+
+static void ReleaseDepScratch(u8 *visited, u16 *order)
+{
+	if(visited == dep_visited) {
+		dep_scratch_used = false;
+		return;
+	}
+	free(order);
+	free(visited);
+}
+
+static u32 GetModuleDepOrder(ModuleHandle *handle, u8 *visited, u16 *order)
+{
+	memset(visited, 0, num_modules);
+	return CollectModuleDeps(GetModuleID(handle), visited, order, 0);
+}
+
+ModuleHandle *ModuleLoadWithDeps(ModuleHandle *handle)
+{
+	debug_assert(handle);
+	u8 *is_new;
+	u16 *order;
+	AcquireDepScratch(&is_new, &order);
+	u32 num_order = GetModuleDepOrder(handle, is_new, order);
+	memset(is_new, 0, num_modules);
+	//Read every missing module first so the closure links against itself in one pass
+	for(u32 i=0; i<num_order; i++) {
+		ModuleHandle *dep = &module_handle_data[order[i]-1];
+		if(!dep->module) {
+			ReadModule(dep);
+			PrepareModule(dep->module, GetModuleBssPtr(dep, dep->module));
+			AddImportLinks(dep);
+			is_new[order[i]-1] = 1;
+		}
+	}
+	for(u32 i=0; i<num_order; i++) {
+		ModuleHandle *dep = &module_handle_data[order[i]-1];
+		if(is_new[order[i]-1]) {
+			ApplyRelocs(dep);
+		}
+	}
+	//Only modules loaded before this call still point at unresolved stubs
+	for(u32 i=0; i<num_order; i++) {
+		if(is_new[order[i]-1]) {
+			FixupExternalModuleReferences(&module_handle_data[order[i]-1], is_new);
+		}
+	}
+	//Start dependencies first now that every call between them is linked
+	for(u32 i=0; i<num_order; i++) {
+		ModuleHandle *dep = &module_handle_data[order[i]-1];
+		if(is_new[order[i]-1]) {
+			//Taken by ModuleLoadHandle for modules loaded alone and released by ModuleUnloadForce
+			if(dep->shared_module != 0) {
+				module_handle_data[dep->shared_module-1].ref_count++;
+			}
+			StartModule(dep);
+		}
+		dep->ref_count++;
+	}
+	ReleaseDepScratch(is_new, order);
+	return handle;
+}
+
+static void UndoModuleImportRelocs(ModuleHeader *module, ImportModule *import, FlushRange *flush)
 {
 	//Get module pointer
 	ModuleHeader *src_module = NULL;
@@ -503,15 +1174,16 @@ static void UndoModuleImportRelocs(ModuleHeader *module, ImportModule *import)
 	}
 	if(src_module) {
 		//Module loaded
-		u16 cur_section = SHN_UNDEF; //Save section for getting relocation pointer
-		for(u32 i=0; i<import->num_relocs; i++) {
-			RelocEntry *reloc = &import->relocs[i];
-			u32 *reloc_ptr = GetSectionPtr(module, cur_section, reloc->offset);
-			switch(reloc->type) {
+		RelocReader reader;
+		InitRelocReader(&reader, module, import);
+		while(ReadReloc(&reader)) {
+			u32 *reloc_ptr = GetSectionPtr(module, reader.section, reader.offset);
+			ExtendFlushRange(flush, reloc_ptr);
+			switch(reader.type) {
 				case R_MIPS_32:
 				//Direct 32-bit pointer relocations
 				{
-					u32 sym_ptr = (u32)GetSectionPtr(src_module, reloc->section, reloc->sym_ofs);
+					u32 sym_ptr = (u32)GetSectionPtr(src_module, reader.sym_section, reader.sym_ofs);
 					*reloc_ptr -= sym_ptr;
 				}
 					break;
@@ -520,7 +1192,7 @@ static void UndoModuleImportRelocs(ModuleHeader *module, ImportModule *import)
 				//26-bit relative pointer relocations
 				//Used for Jumps
 				{
-					u32 sym_ptr = (u32)GetSectionPtr(src_module, reloc->section, reloc->sym_ofs);
+					u32 sym_ptr = (u32)GetSectionPtr(src_module, reader.sym_section, reader.sym_ofs);
 					//Extract original target from instruction and address
 					u32 target = ((*reloc_ptr & 0x3FFFFFF) << 2)|((u32)reloc_ptr & 0xF0000000);
 					target -= (sym_ptr & 0xFFFFFFC);
@@ -536,20 +1208,26 @@ static void UndoModuleImportRelocs(ModuleHeader *module, ImportModule *import)
 					u16 hi_orig = *reloc_ptr & 0xFFFF;
 					u32 addr = hi_orig << 16;
 					u16 hi = hi_orig;
-					//Calculate real hi using next lo
-					for(u32 j=i+1; j<import->num_relocs; j++) {
-						RelocEntry *new_reloc = &import->relocs[j];
-						if(new_reloc->type == R_MIPS_LO16) {
-							//Found lo
-							u32 sym_ptr = (u32)GetSectionPtr(src_module, new_reloc->section, new_reloc->sym_ofs);
-							u32 *lo_ptr = GetSectionPtr(module, cur_section, new_reloc->offset);
-							u16 lo = *lo_ptr & 0xFFFF;
-							//Calculate effective address with lo and symbol pointer
-							addr += lo-((lo & 0x8000) << 1);
-							addr -= sym_ptr;
-							//Calculate hi from effective address
-							hi = (addr >> 16)+((addr & 0x8000) >> 15);
-							break;
+					if(reader.version == MODULE_VERSION_COMPACT_RELOCS) {
+						//Original hi comes from addend alone
+						addr = reader.addend;
+						hi = (addr >> 16)+((addr & 0x8000) >> 15);
+					} else {
+						RelocReader lo_reader = reader;
+						//Calculate real hi using next lo
+						while(ReadReloc(&lo_reader)) {
+							if(lo_reader.type == R_MIPS_LO16) {
+								//Found lo
+								u32 sym_ptr = (u32)GetSectionPtr(src_module, lo_reader.sym_section, lo_reader.sym_ofs);
+								u32 *lo_ptr = GetSectionPtr(module, lo_reader.section, lo_reader.offset);
+								u16 lo = *lo_ptr & 0xFFFF;
+								//Calculate effective address with lo and symbol pointer
+								addr += lo-((lo & 0x8000) << 1);
+								addr -= sym_ptr;
+								//Calculate hi from effective address
+								hi = (addr >> 16)+((addr & 0x8000) >> 15);
+								break;
+							}
 						}
 					}
 					//Write hi
@@ -559,55 +1237,32 @@ static void UndoModuleImportRelocs(ModuleHeader *module, ImportModule *import)
 					
 				case R_MIPS_LO16:
 				{
-					u32 sym_ptr = (u32)GetSectionPtr(src_module, reloc->section, reloc->sym_ofs);
+					u32 sym_ptr = (u32)GetSectionPtr(src_module, reader.sym_section, reader.sym_ofs);
 					u16 lo = *reloc_ptr & 0xFFFF;
 					lo -= sym_ptr;
 					*reloc_ptr = (*reloc_ptr & 0xFFFF0000)|lo;
 				}
 					break;
 					
-				case R_ULTRA_SEC:
-					//Flush cache of previous section
-					FlushSection(module, cur_section);
-					//Change section
-					cur_section = reloc->section;
-					break;
-					
 				default:
-					debug_printf("Unknown relocation type %d.\n", reloc->type);
+					debug_printf("Unknown relocation type %d.\n", reader.type);
 					break;
 			}
 		}
-		//Need to flush cache of last section
-		FlushSection(module, cur_section);
 	}
 }
 
-static void UnlinkModule(ModuleHeader *module)
+static void UnlinkModule(ModuleHandle *handle)
 {
-	u32 module_id = GetModuleID(module);
-	//Do not unlink module 0
-	if(module_id == 0) {
-		return;
-	}
-	//Go through module list undoing import relocations
-	for(u32 i=0; i<num_modules; i++) {
-		//Do not undo this module's relocations
-		if(i+1 != module_id) {
-			//Get other module pointer
-			ModuleHeader *module2 = module_handle_data[i].module;
-			if(!module2) {
-				continue;
-			}
-			//Undo relocations for every import module matching the ID
-			for(u32 j=0; j<module2->num_import_modules; j++) {
-				if(module2->import_modules[j].module_id == module_id) { 
-					UndoModuleImportRelocs(module2, &module2->import_modules[j]);
-					break;
-				}
-			}
-		}
+	//Undo import relocations of every loaded module importing from this module
+	for(ImportLink *link=handle->importers; link; link=link->next) {
+		FlushRange flush;
+		InitFlushRange(&flush);
+		UndoModuleImportRelocs(link->importer->module, link->import, &flush);
+		FlushPatchedRange(&flush);
 	}
+	//This module no longer needs fixing up when its imports load
+	RemoveImportLinks(handle);
 }
 
 static void RunDtors(ModuleHeader *module)
@@ -615,8 +1270,9 @@ static void RunDtors(ModuleHeader *module)
 	if(module->dtor_section == SHN_UNDEF) {
 		return;
 	}
-	ModuleFunc *start = module->section_info[module->dtor_section].ptr;
-	ModuleFunc *end = start+(module->section_info[module->dtor_section].size/sizeof(ModuleFunc));
+	ModuleSection *section = GetSection(module, module->dtor_section);
+	ModuleFunc *start = section->ptr;
+	ModuleFunc *end = start+(section->size/sizeof(ModuleFunc));
 	//Run in reverse order starting from end destructor
 	ModuleFunc *curr = end-1;
 	while(curr >= start) {
@@ -634,10 +1290,20 @@ void ModuleUnloadForce(ModuleHandle *handle)
 	}
 	RunDtors(handle->module);
 	//Remove module from memory
-	UnlinkModule(handle->module);
+	UnlinkModule(handle);
+	RemoveLoadedRange(handle);
 	free(handle->module);
 	handle->ref_count = 0;
 	handle->module = NULL;
+	//Release export table
+	if(handle->exports) {
+		free(handle->exports);
+		handle->exports = NULL;
+	}
+	//Release shared sections
+	if(handle->shared_module != 0) {
+		ModuleUnload(&module_handle_data[handle->shared_module-1]);
+	}
 }
 
 void ModuleUnload(ModuleHandle *handle)
@@ -649,23 +1315,62 @@ void ModuleUnload(ModuleHandle *handle)
 	}
 }
 
+void ModuleUnloadWithDeps(ModuleHandle *handle)
+{
+	debug_assert(handle);
+	u8 *visited;
+	u16 *order;
+	AcquireDepScratch(&visited, &order);
+	u32 num_order = GetModuleDepOrder(handle, visited, order);
+	//Release importers before the modules they import
+	for(u32 i=num_order; i>0; i--) {
+		ModuleHandle *dep = &module_handle_data[order[i-1]-1];
+		if(dep->module) {
+			ModuleUnload(dep);
+		}
+	}
+	ReleaseDepScratch(visited, order);
+}
+
 ModuleHandle *ModuleAddrToHandle(void *ptr)
 {
-	ModuleHandle *handle;
+	//Lock free and allocation free so fault handlers and profilers can call it
 	u32 ptr_val = (u32)ptr;
-	for(u32 i=0; i<num_modules; i++) {
-		u32 top;
-		u32 bottom;
-		handle = &module_handle_data[i];
-		top = (u32)handle->module;
-		if(top != 0) {
-			bottom = top+GetModuleRamSize(handle);
-		} else {
-			bottom = 0;
-		}
-		if(ptr_val >= top && ptr_val < bottom) {
-			return handle;
+	u32 index = FindRangeIndex(ptr_val);
+	if(index != 0 && ptr_val < loaded_ranges[index-1].end) {
+		return loaded_ranges[index-1].handle;
+	}
+	return NULL;
+}
+
+void *ModuleGetSymbol(ModuleHandle *handle, char *name)
+{
+	debug_assert(handle);
+	//Symbols only have addresses while their module is loaded
+	if(!handle->module || handle->export_size == 0) {
+		return NULL;
+	}
+	if(!handle->exports) {
+		//Read export table on first lookup
+		handle->exports = memalign(16, handle->export_size);
+		debug_assert(handle->exports);
+		RomRead(handle->exports, handle->export_ofs, handle->export_size);
+	}
+	ModuleExportTable *table = handle->exports;
+	u32 hash = HashName(name);
+	u32 mask = table->num_slots-1;
+	//Probe until the name or an empty slot is found
+	for(u32 i=hash & mask; table->slots[i].name_ofs != 0; i=(i+1) & mask) {
+		ModuleExport *export = &table->slots[i];
+		if(export->hash == hash && !strcmp((char *)table+export->name_ofs, name)) {
+			ModuleHeader *module = handle->module;
+			if(export->module_id != 0) {
+				//Symbol was moved to the shared module
+				module = module_handle_data[export->module_id-1].module;
+			}
+			return GetSectionPtr(module, export->section, export->offset);
 		}
 	}
+	//Symbol not exported
 	return NULL;
 }
\ No newline at end of file
@@ -1,15 +1,27 @@
 #pragma once
 
+#include <ultra64.h>
 #include "bool.h"
 
 typedef struct module_handle ModuleHandle;
 
 void ModuleInit();
 ModuleHandle *ModuleFind(char *name);
+ModuleHandle *ModuleGetHandleById(u32 id);
 bool ModuleIsLoaded(ModuleHandle *handle);
 void ModulePrintLoadedList();
+//Prelink files saved from ModulePrintLoadedList only hit when the game repeats the same sequence of
+//module loads, unloads, ModuleGetSymbol lookups and other heap allocations as the run they were saved from
+void ModulePrintPrelinkStats();
 ModuleHandle *ModuleLoadHandle(ModuleHandle *handle);
 ModuleHandle *ModuleLoad(char *name);
+ModuleHandle *ModuleLoadId(u32 id);
+void ModuleStartLoader(OSId id, OSPri priority);
+void ModuleLoadAsync(ModuleHandle *handle, OSMesgQueue *done);
+ModuleHandle *ModuleFinishLoad(ModuleHandle *handle);
+ModuleHandle *ModuleLoadWithDeps(ModuleHandle *handle);
 void ModuleUnloadForce(ModuleHandle *handle);
 void ModuleUnload(ModuleHandle *handle);
-ModuleHandle *ModuleAddrToHandle(void *ptr);
\ No newline at end of file
+void ModuleUnloadWithDeps(ModuleHandle *handle);
+ModuleHandle *ModuleAddrToHandle(void *ptr);
+void *ModuleGetSymbol(ModuleHandle *handle, char *name);
\ No newline at end of file
@@ -1,6 +1,23 @@
 #include "rom_read.h"
+#include "debug.h"
 
 static u8 read_buf[ROMREAD_BUF_SIZE] __attribute__((aligned(16))); //16-byte aligned buffer for unaligned reads
+static u8 lz_buf[2][ROMREAD_LZ_CHUNK_SIZE] __attribute__((aligned(16))); //Ring of compressed data chunks
+static OSMesgQueue buf_lock_queue; //Holds one message while the static buffers are free
+static OSMesg buf_lock_msg;
+static u32 buf_lock_created;
+
+typedef struct lz_stream {
+	OSIoMesg io_mesg;
+	OSMesgQueue dma_msg_queue;
+	OSMesg dma_msg;
+	u8 *ptr; //Next compressed byte
+	u8 *end; //End of valid data in current chunk
+	u32 dma_ofs; //ROM offset of next chunk
+	u32 src_end; //ROM offset of end of compressed data
+	u32 next_buf; //Chunk buffer the next DMA goes to
+	u32 next_len; //Valid bytes in the chunk being read
+} LZStream;
 
 static OSPiHandle *GetCartHandle()
 {
@@ -12,6 +29,26 @@ static OSPiHandle *GetCartHandle()
 	return handle;
 }
 
+static void LockBuffers()
+{
+	//Create lock on first use with interrupts disabled so any thread may get there first
+	if(!buf_lock_created) {
+		OSIntMask prev_mask = osSetIntMask(OS_IM_NONE);
+		if(!buf_lock_created) {
+			osCreateMesgQueue(&buf_lock_queue, &buf_lock_msg, 1);
+			osSendMesg(&buf_lock_queue, NULL, OS_MESG_NOBLOCK);
+			buf_lock_created = 1;
+		}
+		osSetIntMask(prev_mask);
+	}
+	osRecvMesg(&buf_lock_queue, NULL, OS_MESG_BLOCK);
+}
+
+static void UnlockBuffers()
+{
+	osSendMesg(&buf_lock_queue, NULL, OS_MESG_NOBLOCK);
+}
+
 void RomRead(void *dst, u32 src, u32 len)
 {
 	OSIoMesg io_mesg;
@@ -59,6 +96,8 @@ void RomRead(void *dst, u32 src, u32 len)
 		//Writeback invalidate destination buffer for RCP usage
 		osWritebackDCache(dst, (len+15) & ~0xF);
 		osInvalDCache(dst, (len+15) & ~0xF);
+		//Module loader thread may read at the same time
+		LockBuffers();
 		//DMA to temporary buffer
 		while(len) {
 			//Calculate chunk copy length
@@ -84,5 +123,126 @@ void RomRead(void *dst, u32 src, u32 len)
 			dst_ptr += copy_len;
 			len -= copy_len;
 		}
+		UnlockBuffers();
+	}
+}
+
+static void LZStartChunk(LZStream *stream)
+{
+	u32 len = stream->src_end-stream->dma_ofs;
+	if(len > ROMREAD_LZ_CHUNK_SIZE) {
+		len = ROMREAD_LZ_CHUNK_SIZE;
+	}
+	stream->next_len = len;
+	if(len == 0) {
+		return;
+	}
+	//Simple invalidate works here since the buffers are aligned to 16 bytes
+	osInvalDCache(lz_buf[stream->next_buf], ROMREAD_LZ_CHUNK_SIZE);
+	//DMA length must be even
+	stream->io_mesg.dramAddr = lz_buf[stream->next_buf];
+	stream->io_mesg.devAddr = stream->dma_ofs;
+	stream->io_mesg.size = (len+1) & ~0x1;
+	osEPiStartDma(GetCartHandle(), &stream->io_mesg, OS_READ);
+	stream->dma_ofs += len;
+}
+
+static void LZNextChunk(LZStream *stream)
+{
+	u8 *buf = lz_buf[stream->next_buf];
+	//Reading past the end of the compressed data would wait forever for a chunk never requested
+	debug_assert(stream->next_len != 0);
+	//Wait for chunk in flight and start reading the one after it into the other buffer
+	osRecvMesg(&stream->dma_msg_queue, &stream->dma_msg, OS_MESG_BLOCK);
+	stream->ptr = buf;
+	stream->end = buf+stream->next_len;
+	stream->next_buf ^= 1;
+	LZStartChunk(stream);
+}
+
+static inline u8 LZReadByte(LZStream *stream)
+{
+	if(stream->ptr == stream->end) {
+		LZNextChunk(stream);
+	}
+	return *stream->ptr++;
+}
+
+static u32 LZReadLength(LZStream *stream, u32 length)
+{
+	u8 value;
+	//Extended lengths continue until a byte below 255
+	do {
+		value = LZReadByte(stream);
+		length += value;
+	} while(value == 255);
+	return length;
+}
+
+void RomReadCompressed(void *dst, u32 dst_len, u32 src, u32 src_len)
+{
+	LZStream stream;
+	u8 *dst_ptr = dst;
+	u8 *dst_end = dst_ptr+dst_len;
+	//Initialize DMA Status
+	osCreateMesgQueue(&stream.dma_msg_queue, &stream.dma_msg, 1);
+	stream.io_mesg.hdr.pri = OS_MESG_PRI_NORMAL;
+	stream.io_mesg.hdr.retQueue = &stream.dma_msg_queue;
+	//Start from even ROM offset and skip the extra byte
+	stream.dma_ofs = src & ~0x1;
+	stream.src_end = src+src_len;
+	stream.next_buf = 0;
+	//Module loader thread may read at the same time
+	LockBuffers();
+	LZStartChunk(&stream);
+	LZNextChunk(&stream);
+	stream.ptr += src & 0x1;
+	//Decompress sequences of literals followed by a match
+	while(dst_ptr < dst_end) {
+		u8 token = LZReadByte(&stream);
+		u32 len = token >> 4;
+		if(len == 15) {
+			len = LZReadLength(&stream, len);
+		}
+		debug_assert(dst_ptr+len <= dst_end);
+		while(len) {
+			u32 copy_len;
+			if(stream.ptr == stream.end) {
+				LZNextChunk(&stream);
+			}
+			//Copy as many literals as the current chunk holds
+			copy_len = stream.end-stream.ptr;
+			if(copy_len > len) {
+				copy_len = len;
+			}
+			bcopy(stream.ptr, dst_ptr, copy_len);
+			stream.ptr += copy_len;
+			dst_ptr += copy_len;
+			len -= copy_len;
+		}
+		if(dst_ptr >= dst_end) {
+			break;
+		}
+		u32 match_ofs = LZReadByte(&stream) << 8;
+		match_ofs |= LZReadByte(&stream);
+		len = token & 0xF;
+		if(len == 15) {
+			len = LZReadLength(&stream, len);
+		}
+		len += 4;
+		debug_assert(match_ofs != 0 && match_ofs <= (u32)(dst_ptr-(u8 *)dst));
+		debug_assert(dst_ptr+len <= dst_end);
+		//Byte copy handles overlapping matches
+		u8 *match = dst_ptr-match_ofs;
+		while(len--) {
+			*dst_ptr++ = *match++;
+		}
 	}
-}
\ No newline at end of file
+	//Wait for any chunk still in flight
+	if(stream.next_len != 0) {
+		osRecvMesg(&stream.dma_msg_queue, &stream.dma_msg, OS_MESG_BLOCK);
+	}
+	UnlockBuffers();
+	//Write decompressed data back to RAM like a DMA read would leave it
+	osWritebackDCache(dst, dst_len);
+}
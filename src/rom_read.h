@@ -3,5 +3,7 @@
 #include <ultra64.h>
 
 #define ROMREAD_BUF_SIZE 16384
+#define ROMREAD_LZ_CHUNK_SIZE 1024
 
-void RomRead(void *dst, u32 src, u32 len);
\ No newline at end of file
+void RomRead(void *dst, u32 src, u32 len);
+void RomReadCompressed(void *dst, u32 dst_len, u32 src, u32 src_len);
\ No newline at end of file
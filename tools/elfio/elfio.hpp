@@ -45,6 +45,7 @@ THE SOFTWARE.
 #include "elfio_section.hpp"
 #include "elfio_segment.hpp"
 #include "elfio_strings.hpp"
+#include "elfio_mapped.hpp"
 
 #define ELFIO_HEADER_ACCESS_GET( TYPE, FNAME ) \
     TYPE get_##FNAME() const { return header ? ( header->get_##FNAME() ) : 0; }
@@ -83,6 +84,7 @@ class elfio
         convertor        = std::move( other.convertor );
         addr_translator  = std::move( other.addr_translator );
         current_file_pos = std::move( other.current_file_pos );
+        mapping          = std::move( other.mapping );
 
         other.header = nullptr;
         other.sections_.clear();
@@ -100,6 +102,7 @@ class elfio
             convertor        = std::move( other.convertor );
             addr_translator  = std::move( other.addr_translator );
             current_file_pos = std::move( other.current_file_pos );
+            mapping          = std::move( other.mapping );
 
             other.header = nullptr;
             other.sections_.clear();
@@ -147,7 +150,30 @@ class elfio
     bool load( std::istream& stream )
     {
         clean();
+        mapping.close();
+        return load_stream( stream );
+    }
+
+    //------------------------------------------------------------------------------
+    //! Loads headers from a memory mapping of the file. Section and segment
+    //! data is only copied out of the mapping on the first get_data() call,
+    //! so unused sections cost neither reads nor heap memory.
+    bool load_mapped( const std::string& file_name )
+    {
+        clean();
+        if ( !mapping.open( file_name ) ) {
+            // Fall back to reading everything up front
+            return load( file_name );
+        }
 
+        memory_streambuf buf( mapping.data(), mapping.size() );
+        std::istream     stream( &buf );
+        return load_stream( stream );
+    }
+
+    //------------------------------------------------------------------------------
+    bool load_stream( std::istream& stream )
+    {
         unsigned char e_ident[EI_NIDENT];
         // Read ELF file signature
         stream.seekg( addr_translator[0] );
@@ -489,6 +515,9 @@ class elfio
 
         for ( Elf_Half i = 0; i < num; ++i ) {
             section* sec = create_section();
+            if ( nullptr != mapping.data() ) {
+                sec->set_lazy_source( mapping.data(), mapping.size() );
+            }
             sec->load( stream,
                        static_cast<std::streamoff>( offset ) +
                            static_cast<std::streampos>( i ) * entry_size );
@@ -554,6 +583,9 @@ class elfio
                 return false;
             }
 
+            if ( nullptr != mapping.data() ) {
+                seg->set_lazy_source( mapping.data(), mapping.size() );
+            }
             seg->load( stream,
                        static_cast<std::streamoff>( offset ) +
                            static_cast<std::streampos>( i ) * entry_size );
@@ -1038,6 +1070,7 @@ class elfio
     std::vector<segment*> segments_;
     endianess_convertor   convertor;
     address_translator    addr_translator;
+    mapped_file           mapping;
 
     Elf_Xword current_file_pos;
 };
@@ -0,0 +1,182 @@
+/*
+Copyright (C) 2001-present by Serge Lamikhov-Center
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef ELFIO_MAPPED_HPP
+#define ELFIO_MAPPED_HPP
+
+#include <string>
+#include <streambuf>
+#include <istream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace ELFIO {
+
+//------------------------------------------------------------------------------
+// Read-only memory mapping of a whole file. Pages are only read from disk
+// when first touched.
+class mapped_file
+{
+  public:
+    //------------------------------------------------------------------------------
+    mapped_file() noexcept : image( nullptr ), image_size( 0 ) {}
+
+    //------------------------------------------------------------------------------
+    mapped_file( mapped_file&& other ) noexcept
+        : image( other.image ), image_size( other.image_size )
+    {
+        other.image      = nullptr;
+        other.image_size = 0;
+    }
+
+    //------------------------------------------------------------------------------
+    mapped_file& operator=( mapped_file&& other ) noexcept
+    {
+        if ( this != &other ) {
+            close();
+            image            = other.image;
+            image_size       = other.image_size;
+            other.image      = nullptr;
+            other.image_size = 0;
+        }
+        return *this;
+    }
+
+    //------------------------------------------------------------------------------
+    // clang-format off
+    mapped_file( const mapped_file& )            = delete;
+    mapped_file& operator=( const mapped_file& ) = delete;
+    // clang-format on
+
+    //------------------------------------------------------------------------------
+    ~mapped_file() { close(); }
+
+    //------------------------------------------------------------------------------
+    bool open( const std::string& file_name )
+    {
+        close();
+#ifdef _WIN32
+        (void)file_name;
+        return false;
+#else
+        int fd = ::open( file_name.c_str(), O_RDONLY );
+        if ( fd < 0 ) {
+            return false;
+        }
+
+        struct stat st;
+        if ( fstat( fd, &st ) != 0 || st.st_size <= 0 ) {
+            ::close( fd );
+            return false;
+        }
+
+        void* ptr = mmap( nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+                          fd, 0 );
+        ::close( fd );
+        if ( ptr == MAP_FAILED ) {
+            return false;
+        }
+
+        image      = static_cast<const char*>( ptr );
+        image_size = (size_t)st.st_size;
+        return true;
+#endif
+    }
+
+    //------------------------------------------------------------------------------
+    void close()
+    {
+#ifndef _WIN32
+        if ( nullptr != image ) {
+            munmap( const_cast<char*>( image ), image_size );
+        }
+#endif
+        image      = nullptr;
+        image_size = 0;
+    }
+
+    //------------------------------------------------------------------------------
+    const char* data() const { return image; }
+
+    //------------------------------------------------------------------------------
+    size_t size() const { return image_size; }
+
+    //------------------------------------------------------------------------------
+  private:
+    const char* image;
+    size_t      image_size;
+};
+
+//------------------------------------------------------------------------------
+// Seekable read-only stream buffer over a block of memory
+class memory_streambuf : public std::streambuf
+{
+  public:
+    //------------------------------------------------------------------------------
+    memory_streambuf( const char* begin, size_t size )
+    {
+        char* ptr = const_cast<char*>( begin );
+        setg( ptr, ptr, ptr + size );
+    }
+
+    //------------------------------------------------------------------------------
+  protected:
+    //------------------------------------------------------------------------------
+    pos_type seekoff( off_type                off,
+                      std::ios_base::seekdir  dir,
+                      std::ios_base::openmode which ) override
+    {
+        if ( ( which & std::ios_base::in ) == 0 ) {
+            return pos_type( off_type( -1 ) );
+        }
+
+        char* base = gptr();
+        if ( dir == std::ios_base::beg ) {
+            base = eback();
+        }
+        else if ( dir == std::ios_base::end ) {
+            base = egptr();
+        }
+
+        if ( off < eback() - base || off > egptr() - base ) {
+            return pos_type( off_type( -1 ) );
+        }
+
+        setg( eback(), base + off, egptr() );
+        return pos_type( gptr() - eback() );
+    }
+
+    //------------------------------------------------------------------------------
+    pos_type seekpos( pos_type pos, std::ios_base::openmode which ) override
+    {
+        return seekoff( off_type( pos ), std::ios_base::beg, which );
+    }
+};
+
+} // namespace ELFIO
+
+#endif // ELFIO_MAPPED_HPP
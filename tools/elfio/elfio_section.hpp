@@ -27,6 +27,7 @@ THE SOFTWARE.
 #include <iostream>
 #include <new>
 #include <limits>
+#include <mutex>
 
 namespace ELFIO {
 
@@ -65,6 +66,7 @@ class section
                        std::streampos header_offset,
                        std::streampos data_offset )                         = 0;
     virtual bool is_address_initialized() const                             = 0;
+    virtual void set_lazy_source( const char* image, size_t image_size )    = 0;
 };
 
 template <class T> class section_impl : public section
@@ -77,15 +79,23 @@ template <class T> class section_impl : public section
     {
         std::fill_n( reinterpret_cast<char*>( &header ), sizeof( header ),
                      '\0' );
-        is_address_set = false;
-        data           = nullptr;
-        data_size      = 0;
-        index          = 0;
-        stream_size    = 0;
+        is_address_set  = false;
+        data            = nullptr;
+        data_size       = 0;
+        index           = 0;
+        stream_size     = 0;
+        lazy_image      = nullptr;
+        lazy_image_size = 0;
+        owns_data       = true;
     }
 
     //------------------------------------------------------------------------------
-    ~section_impl() override { delete[] data; }
+    ~section_impl() override
+    {
+        if ( owns_data ) {
+            delete[] data;
+        }
+    }
 
     //------------------------------------------------------------------------------
     // Section info functions
@@ -120,14 +130,25 @@ template <class T> class section_impl : public section
     bool is_address_initialized() const override { return is_address_set; }
 
     //------------------------------------------------------------------------------
-    const char* get_data() const override { return data; }
+    const char* get_data() const override
+    {
+        if ( nullptr != lazy_image ) {
+            // Materialize data of mapped sections on first use
+            std::call_once( lazy_once, [this]() { load_lazy_data(); } );
+        }
+        return data;
+    }
 
     //------------------------------------------------------------------------------
     void set_data( const char* raw_data, Elf_Word size ) override
     {
+        lazy_image = nullptr;
         if ( get_type() != SHT_NOBITS ) {
-            delete[] data;
-            data = new ( std::nothrow ) char[size];
+            if ( owns_data ) {
+                delete[] data;
+            }
+            data      = new ( std::nothrow ) char[size];
+            owns_data = true;
             if ( nullptr != data && nullptr != raw_data ) {
                 data_size = size;
                 std::copy( raw_data, raw_data + size, data );
@@ -149,6 +170,8 @@ template <class T> class section_impl : public section
     //------------------------------------------------------------------------------
     void append_data( const char* raw_data, Elf_Word size ) override
     {
+        get_data();
+        lazy_image = nullptr;
         if ( get_type() != SHT_NOBITS ) {
             if ( get_size() + size < data_size ) {
                 std::copy( raw_data, raw_data + size, data + get_size() );
@@ -161,8 +184,11 @@ template <class T> class section_impl : public section
                     std::copy( data, data + get_size(), new_data );
                     std::copy( raw_data, raw_data + size,
                                new_data + get_size() );
-                    delete[] data;
-                    data = new_data;
+                    if ( owns_data ) {
+                        delete[] data;
+                    }
+                    data      = new_data;
+                    owns_data = true;
                 }
                 else {
                     size = 0;
@@ -186,6 +212,13 @@ template <class T> class section_impl : public section
     //------------------------------------------------------------------------------
     void set_index( Elf_Half value ) override { index = value; }
 
+    //------------------------------------------------------------------------------
+    void set_lazy_source( const char* image, size_t image_size ) override
+    {
+        lazy_image      = image;
+        lazy_image_size = image_size;
+    }
+
     //------------------------------------------------------------------------------
     void load( std::istream& stream, std::streampos header_offset ) override
     {
@@ -204,6 +237,10 @@ template <class T> class section_impl : public section
         stream.read( reinterpret_cast<char*>( &header ), sizeof( header ) );
 
         Elf_Xword size = get_size();
+        if ( nullptr != lazy_image ) {
+            // Section data is read from the mapped image by get_data()
+            return;
+        }
         if ( nullptr == data && SHT_NULL != get_type() &&
              SHT_NOBITS != get_type() && size < get_stream_size() ) {
             data = new ( std::nothrow ) char[size + 1];
@@ -255,6 +292,37 @@ template <class T> class section_impl : public section
         stream.write( get_data(), get_size() );
     }
 
+    //------------------------------------------------------------------------------
+    void load_lazy_data() const
+    {
+        Elf_Xword size   = get_size();
+        size_t    offset = ( *translator )[get_offset()];
+        if ( nullptr == data && SHT_NULL != get_type() &&
+             SHT_NOBITS != get_type() && size < get_stream_size() &&
+             offset <= lazy_image_size && size <= lazy_image_size - offset ) {
+            if ( 0 != size && SHT_STRTAB != get_type() ) {
+                // Point straight into the mapping; only string tables need
+                // the extra terminator of a private copy
+                data      = const_cast<char*>( lazy_image + offset );
+                data_size = size;
+                owns_data = false;
+                return;
+            }
+
+            data = new ( std::nothrow ) char[size + 1];
+
+            if ( ( 0 != size ) && ( nullptr != data ) ) {
+                std::copy( lazy_image + offset, lazy_image + offset + size,
+                           data );
+                data[size] = 0; // Ensure data is ended with 0 to avoid oob read
+                data_size  = size;
+            }
+            else {
+                data_size = 0;
+            }
+        }
+    }
+
     //------------------------------------------------------------------------------
     size_t get_stream_size() const { return stream_size; }
 
@@ -266,12 +334,16 @@ template <class T> class section_impl : public section
     T                          header;
     Elf_Half                   index;
     std::string                name;
-    char*                      data;
-    Elf_Word                   data_size;
+    mutable char*              data;
+    mutable Elf_Word           data_size;
     const endianess_convertor* convertor;
     const address_translator*  translator;
     bool                       is_address_set;
     size_t                     stream_size;
+    const char*                lazy_image;
+    size_t                     lazy_image_size;
+    mutable std::once_flag     lazy_once;
+    mutable bool               owns_data;
 };
 
 } // namespace ELFIO
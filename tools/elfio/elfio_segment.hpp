@@ -25,6 +25,7 @@ THE SOFTWARE.
 
 #include <iostream>
 #include <vector>
+#include <mutex>
 #include <new>
 #include <limits>
 
@@ -65,6 +66,7 @@ class segment
     virtual void save( std::ostream&  stream,
                        std::streampos header_offset,
                        std::streampos data_offset )                         = 0;
+    virtual void set_lazy_source( const char* image, size_t image_size )    = 0;
 };
 
 //------------------------------------------------------------------------------
@@ -75,7 +77,8 @@ template <class T> class segment_impl : public segment
     segment_impl( const endianess_convertor* convertor,
                   const address_translator*  translator )
         : index( 0 ), data( nullptr ), convertor( convertor ),
-          translator( translator ), stream_size( 0 ), is_offset_set( false )
+          translator( translator ), stream_size( 0 ), is_offset_set( false ),
+          lazy_image( nullptr ), lazy_image_size( 0 )
     {
         std::fill_n( reinterpret_cast<char*>( &ph ), sizeof( ph ), '\0' );
     }
@@ -98,7 +101,14 @@ template <class T> class segment_impl : public segment
     Elf_Half get_index() const override { return index; }
 
     //------------------------------------------------------------------------------
-    const char* get_data() const override { return data; }
+    const char* get_data() const override
+    {
+        if ( nullptr != lazy_image ) {
+            // Materialize data of mapped segments on first use
+            std::call_once( lazy_once, [this]() { load_lazy_data(); } );
+        }
+        return data;
+    }
 
     //------------------------------------------------------------------------------
     Elf_Half add_section_index( Elf_Half  sec_index,
@@ -158,6 +168,13 @@ template <class T> class segment_impl : public segment
     //------------------------------------------------------------------------------
     void set_index( Elf_Half value ) override { index = value; }
 
+    //------------------------------------------------------------------------------
+    void set_lazy_source( const char* image, size_t image_size ) override
+    {
+        lazy_image      = image;
+        lazy_image_size = image_size;
+    }
+
     //------------------------------------------------------------------------------
     void load( std::istream& stream, std::streampos header_offset ) override
     {
@@ -173,6 +190,11 @@ template <class T> class segment_impl : public segment
         stream.read( reinterpret_cast<char*>( &ph ), sizeof( ph ) );
         is_offset_set = true;
 
+        if ( nullptr != lazy_image ) {
+            // Segment data is read from the mapped image by get_data()
+            return;
+        }
+
         if ( PT_NULL != get_type() && 0 != get_file_size() ) {
             stream.seekg( ( *translator )[( *convertor )( ph.p_offset )] );
             Elf_Xword size = get_file_size();
@@ -202,6 +224,24 @@ template <class T> class segment_impl : public segment
         stream.write( reinterpret_cast<const char*>( &ph ), sizeof( ph ) );
     }
 
+    //------------------------------------------------------------------------------
+    void load_lazy_data() const
+    {
+        Elf_Xword size   = get_file_size();
+        size_t    offset = ( *translator )[get_offset()];
+        if ( PT_NULL != get_type() && 0 != size &&
+             size <= get_stream_size() && offset <= lazy_image_size &&
+             size <= lazy_image_size - offset ) {
+            data = new ( std::nothrow ) char[size + 1];
+
+            if ( nullptr != data ) {
+                std::copy( lazy_image + offset, lazy_image + offset + size,
+                           data );
+                data[size] = 0;
+            }
+        }
+    }
+
     //------------------------------------------------------------------------------
     size_t get_stream_size() const { return stream_size; }
 
@@ -212,12 +252,15 @@ template <class T> class segment_impl : public segment
   private:
     T                          ph;
     Elf_Half                   index;
-    char*                      data;
+    mutable char*              data;
     std::vector<Elf_Half>      sections;
     const endianess_convertor* convertor;
     const address_translator*  translator;
     size_t                     stream_size;
     bool                       is_offset_set;
+    const char*                lazy_image;
+    size_t                     lazy_image_size;
+    mutable std::once_flag     lazy_once;
 };
 
 } // namespace ELFIO
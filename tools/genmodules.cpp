@@ -0,0 +1,349 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "elfio/elfio.hpp"
+
+#define R_MIPS_32 2
+#define R_MIPS_26 4
+#define R_MIPS_HI16 5
+#define R_MIPS_LO16 6
+
+#define MAIN_TEXT_ADDR 0x80000400
+#define FUNC_SIZE 16
+
+struct GenConfig {
+    uint32_t num_modules;
+    uint32_t num_symbols; //Functions defined per module
+    uint32_t num_relocs; //Relocation sites per module
+    uint32_t import_pct; //Percentage of sites importing other modules
+    uint32_t main_pct; //Percentage of sites importing the main executable
+    uint32_t num_main_symbols;
+    bool function_sections;
+};
+
+struct GenReloc {
+    uint32_t offset;
+    uint32_t symbol;
+    uint8_t type;
+};
+
+uint32_t rng_state = 1;
+
+uint32_t Rand()
+{
+    //Fixed LCG so output only depends on the seed
+    rng_state = (rng_state * 1103515245) + 12345;
+    return rng_state >> 8;
+}
+
+uint32_t AlignU32(uint32_t val, uint32_t to)
+{
+    return (val + to - 1) & ~(to - 1);
+}
+
+void SetBufferU32(std::vector<uint8_t>& buf, uint32_t ofs, uint32_t value)
+{
+    buf[ofs] = value >> 24;
+    buf[ofs + 1] = (value >> 16) & 0xFF;
+    buf[ofs + 2] = (value >> 8) & 0xFF;
+    buf[ofs + 3] = value & 0xFF;
+}
+
+void CreateELF(ELFIO::elfio& writer, ELFIO::Elf_Half type)
+{
+    writer.create(ELFIO::ELFCLASS32, ELFIO::ELFDATA2MSB);
+    writer.set_os_abi(ELFIO::ELFOSABI_NONE);
+    writer.set_type(type);
+    writer.set_machine(ELFIO::EM_MIPS);
+}
+
+ELFIO::section* AddSection(ELFIO::elfio& writer, const std::string& name, ELFIO::Elf_Word type, ELFIO::Elf_Xword flags, uint32_t align)
+{
+    ELFIO::section* section = writer.sections.add(name);
+    section->set_type(type);
+    section->set_flags(flags);
+    section->set_addr_align(align);
+    return section;
+}
+
+ELFIO::section* AddSymbolTable(ELFIO::elfio& writer)
+{
+    ELFIO::section* str_sec = AddSection(writer, ".strtab", ELFIO::SHT_STRTAB, 0, 1);
+    ELFIO::section* sym_sec = AddSection(writer, ".symtab", ELFIO::SHT_SYMTAB, 0, 4);
+    sym_sec->set_link(str_sec->get_index());
+    sym_sec->set_entry_size(writer.get_default_entry_size(ELFIO::SHT_SYMTAB));
+    return sym_sec;
+}
+
+void AddRelocations(ELFIO::elfio& writer, ELFIO::section* sym_sec, ELFIO::section* target, const std::vector<GenReloc>& relocs)
+{
+    if (relocs.empty()) {
+        return;
+    }
+    ELFIO::section* rel_sec = AddSection(writer, ".rel" + target->get_name(), ELFIO::SHT_REL, 0, 4);
+    rel_sec->set_info(target->get_index());
+    rel_sec->set_link(sym_sec->get_index());
+    rel_sec->set_entry_size(writer.get_default_entry_size(ELFIO::SHT_REL));
+    ELFIO::relocation_section_accessor rel_writer(writer, rel_sec);
+    for (const GenReloc& reloc : relocs) {
+        rel_writer.add_entry(reloc.offset, reloc.symbol, reloc.type);
+    }
+}
+
+bool SaveELF(ELFIO::elfio& writer, const std::string& path)
+{
+    if (!writer.save(path)) {
+        std::cout << "Failed to write ELF file " << path << "." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool WriteMain(const std::string& path, const GenConfig& config)
+{
+    ELFIO::elfio writer;
+    CreateELF(writer, ELFIO::ET_EXEC);
+    ELFIO::section* text = AddSection(writer, ".text", ELFIO::SHT_PROGBITS, ELFIO::SHF_ALLOC | ELFIO::SHF_EXECINSTR, 16);
+    std::vector<uint8_t> text_data(config.num_main_symbols * FUNC_SIZE, 0);
+    text->set_address(MAIN_TEXT_ADDR);
+    text->set_data((const char*)text_data.data(), text_data.size());
+    ELFIO::section* sym_sec = AddSymbolTable(writer);
+    ELFIO::string_section_accessor str_writer(writer.sections[sym_sec->get_link()]);
+    ELFIO::symbol_section_accessor sym_writer(writer, sym_sec);
+    sym_sec->set_info(1);
+    for (uint32_t i = 0; i < config.num_main_symbols; i++) {
+        std::string name = "main_f" + std::to_string(i);
+        sym_writer.add_symbol(str_writer, name.c_str(), MAIN_TEXT_ADDR + (i * FUNC_SIZE), FUNC_SIZE, ELFIO::STB_GLOBAL, ELFIO::STT_FUNC, 0, text->get_index());
+    }
+    return SaveELF(writer, path);
+}
+
+bool WriteModule(const std::string& path, uint32_t id, const GenConfig& config)
+{
+    ELFIO::elfio writer;
+    CreateELF(writer, ELFIO::ET_REL);
+    //Shared text holds module entry points, unsplit functions and relocation sites
+    uint32_t num_text_funcs = config.function_sections ? 2 : config.num_symbols;
+    uint32_t sites_ofs = AlignU32(num_text_funcs * FUNC_SIZE, 16);
+    std::vector<uint8_t> text_data(AlignU32(sites_ofs + (config.num_relocs * 8) + 16, 16), 0);
+    std::vector<uint8_t> data_data(AlignU32((config.num_relocs * 4) + 16, 16), 0);
+    std::vector<uint8_t> rodata_data(64 + (id % 13), 0x5A);
+    std::vector<uint8_t> ctors_data(4, 0);
+    ELFIO::section* text = AddSection(writer, ".text", ELFIO::SHT_PROGBITS, ELFIO::SHF_ALLOC | ELFIO::SHF_EXECINSTR, 16);
+    ELFIO::section* ctors = AddSection(writer, ".ctors", ELFIO::SHT_PROGBITS, ELFIO::SHF_ALLOC | ELFIO::SHF_WRITE, 4);
+    ELFIO::section* rodata = AddSection(writer, ".rodata", ELFIO::SHT_PROGBITS, ELFIO::SHF_ALLOC, 8);
+    ELFIO::section* data = AddSection(writer, ".data", ELFIO::SHT_PROGBITS, ELFIO::SHF_ALLOC | ELFIO::SHF_WRITE, 8);
+    ELFIO::section* bss = AddSection(writer, ".bss", ELFIO::SHT_NOBITS, ELFIO::SHF_ALLOC | ELFIO::SHF_WRITE, 16);
+    bss->set_size(256 + ((id * 4) % 64));
+    std::vector<ELFIO::section*> func_secs;
+    if (config.function_sections) {
+        //One section per function like -ffunction-sections
+        for (uint32_t i = num_text_funcs; i < config.num_symbols; i++) {
+            std::string name = ".text.m" + std::to_string(id) + "_f" + std::to_string(i);
+            func_secs.push_back(AddSection(writer, name, ELFIO::SHT_PROGBITS, ELFIO::SHF_ALLOC | ELFIO::SHF_EXECINSTR, 8));
+        }
+    }
+    ELFIO::section* strings = NULL;
+    if (config.function_sections) {
+        //Merged string constants with the same contents in most modules
+        strings = AddSection(writer, ".rodata.str1.4", ELFIO::SHT_PROGBITS, ELFIO::SHF_ALLOC | ELFIO::SHF_MERGE | ELFIO::SHF_STRINGS, 4);
+    }
+    ELFIO::section* sym_sec = AddSymbolTable(writer);
+    ELFIO::string_section_accessor str_writer(writer.sections[sym_sec->get_link()]);
+    ELFIO::symbol_section_accessor sym_writer(writer, sym_sec);
+    //Section symbols come first as locals
+    ELFIO::section* local_sections[] = { text, ctors, rodata, data, bss };
+    std::vector<uint32_t> section_syms;
+    for (ELFIO::section* section : local_sections) {
+        section_syms.push_back(sym_writer.add_symbol(str_writer, "", 0, 0, ELFIO::STB_LOCAL, ELFIO::STT_SECTION, 0, section->get_index()));
+    }
+    sym_sec->set_info(section_syms.size() + 1);
+    //Defined functions
+    std::vector<uint32_t> func_syms;
+    for (uint32_t i = 0; i < config.num_symbols; i++) {
+        std::string name = "m" + std::to_string(id) + "_f" + std::to_string(i);
+        if (i < num_text_funcs) {
+            func_syms.push_back(sym_writer.add_symbol(str_writer, name.c_str(), i * FUNC_SIZE, FUNC_SIZE, ELFIO::STB_GLOBAL, ELFIO::STT_FUNC, 0, text->get_index()));
+        }
+        else {
+            ELFIO::section* func_sec = func_secs[i - num_text_funcs];
+            std::vector<uint8_t> func_data(FUNC_SIZE, 0x11);
+            func_sec->set_data((const char*)func_data.data(), func_data.size());
+            func_syms.push_back(sym_writer.add_symbol(str_writer, name.c_str(), 0, FUNC_SIZE, ELFIO::STB_GLOBAL, ELFIO::STT_FUNC, 0, func_sec->get_index()));
+        }
+    }
+    uint32_t prolog_sym = sym_writer.add_symbol(str_writer, "_prolog", 0, FUNC_SIZE, ELFIO::STB_GLOBAL, ELFIO::STT_FUNC, 0, text->get_index());
+    sym_writer.add_symbol(str_writer, "_epilog", FUNC_SIZE, FUNC_SIZE, ELFIO::STB_GLOBAL, ELFIO::STT_FUNC, 0, text->get_index());
+    uint32_t string_sym = 0;
+    if (strings) {
+        std::string text = (id % 5 == 4) ? "unique " + std::to_string(id) : "shared constant strings";
+        std::vector<uint8_t> string_data(text.begin(), text.end());
+        string_data.resize(AlignU32(string_data.size() + 1, 4), 0);
+        strings->set_data((const char*)string_data.data(), string_data.size());
+        string_sym = sym_writer.add_symbol(str_writer, ("str_m" + std::to_string(id)).c_str(), 0, string_data.size(), ELFIO::STB_GLOBAL, ELFIO::STT_OBJECT, 0, strings->get_index());
+    }
+    //Undefined symbols are added once per name
+    std::vector<uint32_t> main_syms(config.num_main_symbols, 0);
+    std::vector<std::vector<uint32_t>> module_syms(config.num_modules);
+    std::vector<GenReloc> text_relocs;
+    std::vector<GenReloc> data_relocs;
+    std::vector<GenReloc> ctors_relocs = { { 0, prolog_sym, R_MIPS_32 } };
+    uint32_t text_ofs = sites_ofs;
+    uint32_t data_ofs = 0;
+    for (uint32_t i = 0; i < config.num_relocs; i++) {
+        //Pick relocation target
+        uint32_t symbol;
+        uint32_t target = Rand() % 100;
+        if (target < config.import_pct && config.num_modules > 1) {
+            uint32_t other = Rand() % (config.num_modules - 1);
+            if (other >= id) {
+                other++;
+            }
+            uint32_t func = Rand() % config.num_symbols;
+            if (module_syms[other].empty()) {
+                module_syms[other].assign(config.num_symbols, 0);
+            }
+            if (module_syms[other][func] == 0) {
+                std::string name = "m" + std::to_string(other) + "_f" + std::to_string(func);
+                module_syms[other][func] = sym_writer.add_symbol(str_writer, name.c_str(), 0, 0, ELFIO::STB_GLOBAL, ELFIO::STT_NOTYPE, 0, ELFIO::SHN_UNDEF);
+            }
+            symbol = module_syms[other][func];
+        }
+        else if (target < config.import_pct + config.main_pct) {
+            uint32_t func = Rand() % config.num_main_symbols;
+            if (main_syms[func] == 0) {
+                std::string name = "main_f" + std::to_string(func);
+                main_syms[func] = sym_writer.add_symbol(str_writer, name.c_str(), 0, 0, ELFIO::STB_GLOBAL, ELFIO::STT_NOTYPE, 0, ELFIO::SHN_UNDEF);
+            }
+            symbol = main_syms[func];
+        }
+        else if (strings && target % 7 == 0) {
+            symbol = string_sym;
+        }
+        else if (target & 1) {
+            //Function sections beyond the first few stay unreferenced for dead section removal
+            uint32_t func = Rand() % config.num_symbols;
+            if (config.function_sections && Rand() % 4 != 0) {
+                func %= num_text_funcs;
+            }
+            symbol = func_syms[func];
+        }
+        else {
+            symbol = section_syms[Rand() % section_syms.size()];
+        }
+        //Pick relocation kind
+        switch (Rand() % 3) {
+            case 0:
+                SetBufferU32(text_data, text_ofs, 0x0C000000);
+                text_relocs.push_back({ text_ofs, symbol, R_MIPS_26 });
+                break;
+
+            case 1:
+            {
+                //lui/addiu pair with a random addend
+                uint32_t addend = Rand() % 0x10000;
+                SetBufferU32(text_data, text_ofs, 0x3C040000 | ((addend + 0x8000) >> 16));
+                SetBufferU32(text_data, text_ofs + 4, 0x24840000 | (addend & 0xFFFF));
+                text_relocs.push_back({ text_ofs, symbol, R_MIPS_HI16 });
+                text_relocs.push_back({ text_ofs + 4, symbol, R_MIPS_LO16 });
+            }
+                break;
+
+            default:
+                SetBufferU32(data_data, data_ofs, Rand() % 64);
+                data_relocs.push_back({ data_ofs, symbol, R_MIPS_32 });
+                data_ofs += 4;
+                break;
+        }
+        text_ofs += 8;
+    }
+    text->set_data((const char*)text_data.data(), text_data.size());
+    data->set_data((const char*)data_data.data(), data_data.size());
+    rodata->set_data((const char*)rodata_data.data(), rodata_data.size());
+    ctors->set_data((const char*)ctors_data.data(), ctors_data.size());
+    AddRelocations(writer, sym_sec, text, text_relocs);
+    AddRelocations(writer, sym_sec, ctors, ctors_relocs);
+    AddRelocations(writer, sym_sec, data, data_relocs);
+    return SaveELF(writer, path);
+}
+
+void PrintUsage(const char* name)
+{
+    std::cout << "Usage: " << name << " [-n modules] [-s symbols] [-r relocs] [-i import_pct] [-m main_pct] [-x seed] [-f] out_dir" << std::endl;
+    std::cout << "Writes a synthetic main.elf and mod0.elf to modN.elf for benchmarking makemodule." << std::endl;
+    std::cout << "-n sets the module count (default 20)." << std::endl;
+    std::cout << "-s sets the functions defined per module (default 64)." << std::endl;
+    std::cout << "-r sets the relocation sites per module (default 256)." << std::endl;
+    std::cout << "-i sets the percentage of sites importing other modules (default 20)." << std::endl;
+    std::cout << "-m sets the percentage of sites importing the main executable (default 20)." << std::endl;
+    std::cout << "-x sets the random seed (default 1)." << std::endl;
+    std::cout << "-f puts functions in their own sections and adds duplicated string constants." << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    GenConfig config = { 20, 64, 256, 20, 20, 1024, false };
+    int arg_base = 1;
+    //Parse options
+    while (arg_base < argc && argv[arg_base][0] == '-') {
+        std::string option = argv[arg_base];
+        uint32_t* value = NULL;
+        if (option == "-n") {
+            value = &config.num_modules;
+        }
+        else if (option == "-s") {
+            value = &config.num_symbols;
+        }
+        else if (option == "-r") {
+            value = &config.num_relocs;
+        }
+        else if (option == "-i") {
+            value = &config.import_pct;
+        }
+        else if (option == "-m") {
+            value = &config.main_pct;
+        }
+        else if (option == "-x") {
+            value = &rng_state;
+        }
+        else if (option == "-f") {
+            config.function_sections = true;
+            arg_base++;
+            continue;
+        }
+        else {
+            std::cout << "Unknown option " << option << "." << std::endl;
+            return 1;
+        }
+        if (arg_base + 1 >= argc) {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+        *value = strtoul(argv[arg_base + 1], NULL, 0);
+        arg_base += 2;
+    }
+    if (argc - arg_base != 1 || config.num_symbols < 2 || config.import_pct + config.main_pct > 100) {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+    std::string out_dir = argv[arg_base];
+    std::error_code error;
+    std::filesystem::create_directories(out_dir, error);
+    if (error) {
+        std::cout << "Failed to create directory " << out_dir << "." << std::endl;
+        return 1;
+    }
+    if (!WriteMain(out_dir + "/main.elf", config)) {
+        return 1;
+    }
+    for (uint32_t i = 0; i < config.num_modules; i++) {
+        if (!WriteModule(out_dir + "/mod" + std::to_string(i) + ".elf", i, config)) {
+            return 1;
+        }
+    }
+    return 0;
+}
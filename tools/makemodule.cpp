@@ -1,9 +1,28 @@
 #define _CRT_SECURE_NO_WARNINGS
 #include <stdio.h>
+#include <algorithm>
 #include <filesystem>
 #include <iostream>
+#include <iomanip>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <atomic>
+#include <cstring>
+#include <cctype>
+#include <chrono>
+#include <sstream>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#endif
 #include "elfio/elfio.hpp"
 #include "elfio/elf_types.hpp"
 
@@ -13,10 +32,69 @@
 #define R_MIPS_LO16 6
 #define R_ULTRA_SEC 100
 
+#define MODULE_VERSION_FIXED_RELOCS 0
+#define MODULE_VERSION_COMPACT_RELOCS 1
+
+//Compact relocation head flags
+#define RELOC_TYPE_MASK 0x3
+#define RELOC_NEW_SECTION 0x4
+#define RELOC_NEW_SYM_OFS 0x8
+#define RELOC_FLAG_BITS 4
+#define RELOC_SELF_BSS 0x4
+#define RELOC_SELF_FLAG_BITS 3
+
+#define MODULE_HANDLE_SIZE 80
+
+//Generated module holding sections duplicated across modules
+#define SHARED_MODULE_NAME "__shared"
+
+//LZ4-style compressed module payloads
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xFFFF
+#define LZ_HASH_BITS 14
+#define LZ_MAX_CHAIN 64
+
+//Bump whenever the module blob layout or import generation changes
+#define MODULE_CACHE_VERSION 10
+
+//Symbols listed per module in reports
+#define REPORT_TOP_SYMBOLS 10
+
+//Export table layout
+#define EXPORT_HEADER_SIZE 8
+#define EXPORT_SLOT_SIZE 16
+
+//Module name hash table after the handles
+#define NAME_TABLE_HEADER_SIZE 4
+#define NAME_TABLE_SLOT_SIZE 8
+
+struct ELFSymbol {
+    std::string name;
+    uint32_t addr;
+    uint8_t bind;
+    uint8_t type;
+    uint16_t section;
+};
+
 struct ELFFile {
     std::string name;
     std::string orig_path;
     ELFIO::elfio* reader;
+    ELFIO::section* symtab;
+    std::vector<ELFSymbol> symbols;
+    std::unordered_map<std::string, uint32_t> exports;
+    std::unordered_map<std::string, uint32_t> section_indices;
+    std::vector<uint16_t> compact_sections;
+    std::vector<bool> live_sections; //Empty when dead sections are kept
+    std::vector<std::vector<uint32_t>> section_rels; //Relocation sections patching each section
+    std::vector<uint16_t> shared_indices; //Shared module section of hoisted sections
+    bool uses_shared_module;
+};
+
+struct ELFRelocation {
+    ELFIO::Elf64_Addr offset;
+    ELFIO::Elf_Word symbol;
+    unsigned char type;
 };
 
 struct RelocRecord {
@@ -24,6 +102,13 @@ struct RelocRecord {
     uint8_t type;
     uint16_t section;
     uint32_t sym_ofs;
+    int32_t addend; //Full HI16 addend including paired LO16
+};
+
+struct PendingReloc {
+    uint16_t target_section;
+    uint32_t sort_offset; //Paired LO16 offset for fixed format HI16 relocations
+    RelocRecord reloc;
 };
 
 struct SectionInfo {
@@ -32,11 +117,22 @@ struct SectionInfo {
     uint32_t size;
 };
 
+struct ModuleStats {
+    uint32_t header_size;
+    uint32_t data_size;
+    uint32_t reloc_size; //Import table and relocation lists
+    uint32_t padding_size;
+    std::map<uint32_t, uint32_t> target_relocs; //Relocations by target module, 0 for main executable
+    std::map<uint8_t, uint32_t> type_relocs;
+    std::unordered_map<std::string, uint32_t> symbol_imports; //Relocations against each external symbol
+};
+
 struct ModuleData {
     uint32_t elf_id;
     std::string name;
     std::map<uint32_t, std::vector<RelocRecord>> imports;
     std::map<uint32_t, uint16_t> import_reloc_section;
+    std::vector<RelocRecord> static_relocs; //Main executable relocations applied at build time
     uint16_t ctor_section;
     uint16_t dtor_section;
     uint16_t prolog_section;
@@ -46,6 +142,26 @@ struct ModuleData {
     uint32_t epilog_addr;
     uint32_t unresolved_addr;
     uint32_t total_size;
+    std::vector<uint8_t> blob;
+    std::vector<uint8_t> rom_data; //Compressed blob, empty when stored raw
+    ModuleStats stats; //Only filled in when a report or budget is requested
+    std::vector<uint8_t> export_table; //Read by ModuleGetSymbol, empty without exports
+    std::vector<uint16_t> deps; //IDs of modules imported from, loaded first by ModuleLoadWithDeps
+};
+
+struct ExportSlot {
+    uint32_t hash;
+    uint32_t name_ofs; //From start of export table, 0 for empty slots
+    uint32_t offset;
+    uint16_t section;
+    uint16_t module_id; //0 for the exporting module
+};
+
+struct ModuleBudget {
+    uint32_t ram;
+    uint32_t rom;
+    uint32_t relocs;
+    uint32_t reloc_bytes;
 };
 
 struct SymbolSearchResult {
@@ -54,8 +170,106 @@ struct SymbolSearchResult {
     uint32_t addr;
 };
 
+struct GlobalSymbol {
+    SymbolSearchResult def;
+    bool weak;
+    bool duplicate;
+    uint32_t duplicate_module;
+};
+
+struct SharedSection {
+    uint32_t elf_id; //Module whose copy is stored in the shared module
+    uint32_t section;
+    uint32_t num_copies;
+};
+
 std::vector<ELFFile> elf_files;
 std::vector<ModuleData> modules_data;
+std::unordered_map<std::string, GlobalSymbol> global_symbols;
+thread_local bool is_worker_thread = false;
+std::atomic<bool> worker_failed(false);
+std::string cache_dir;
+uint16_t module_version = MODULE_VERSION_COMPACT_RELOCS;
+bool compress_modules = false;
+bool remove_dead_sections = false;
+bool share_sections = false;
+std::vector<SharedSection> shared_sections;
+uint32_t shared_module_id = 0; //0 when no sections are shared
+bool print_compression_report = false;
+bool collect_module_stats = false;
+std::unordered_map<std::string, uint32_t> prelink_addrs; //Preferred load address of each module
+std::unordered_set<std::string> kept_symbols; //Symbols kept by dead section removal for runtime lookup
+std::string report_path;
+std::unordered_map<std::string, ModuleBudget> module_budgets; //"*" applies to unlisted modules
+
+enum BuildPhase {
+    PHASE_LOAD_ELF,
+    PHASE_SYMBOL_INDEX,
+    PHASE_DEAD_SECTIONS,
+    PHASE_SHARE_SECTIONS,
+    PHASE_PROCESS_MODULES,
+    PHASE_READ_MODULE,
+    PHASE_WRITE_MODULE,
+    PHASE_COMPRESS,
+    PHASE_EXPORT_TABLE,
+    PHASE_REPORTS,
+    PHASE_WRITE_OUTPUT,
+    PHASE_COUNT
+};
+
+const char* phase_names[PHASE_COUNT] = {
+    "ELF load",
+    "Symbol resolution",
+    "Dead section removal",
+    "Section sharing",
+    "Module processing",
+    "  Import generation",
+    "  Module encoding",
+    "  Compression",
+    "  Export tables",
+    "Reports",
+    "Output write"
+};
+
+std::atomic<uint64_t> phase_times[PHASE_COUNT]; //Microseconds, per-module phases are summed over jobs
+bool print_phase_times = false;
+
+std::chrono::steady_clock::time_point StartPhase()
+{
+    return std::chrono::steady_clock::now();
+}
+
+void EndPhase(BuildPhase phase, std::chrono::steady_clock::time_point start)
+{
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    phase_times[phase] += std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+}
+
+void PrintPhaseTimes()
+{
+    std::cout << "Phase times:" << std::endl;
+    std::cout << std::fixed << std::setprecision(2);
+    double total = 0;
+    for (uint32_t i = 0; i < PHASE_COUNT; i++) {
+        double time = phase_times[i] / 1000.0;
+        std::cout << phase_names[i] << ": " << time << " ms" << std::endl;
+        if (phase_names[i][0] != ' ') {
+            //Indented phases are already counted by module processing
+            total += time;
+        }
+    }
+    std::cout << "Total: " << total << " ms" << std::endl;
+#ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+        //macOS reports bytes instead of kilobytes
+        usage.ru_maxrss /= 1024;
+#endif
+        std::cout << "Peak RSS: " << usage.ru_maxrss << " KB" << std::endl;
+    }
+#endif
+}
 
 void DeleteELFReaders()
 {
@@ -65,8 +279,15 @@ void DeleteELFReaders()
     }
 }
 
+struct WorkerTerminated {
+};
+
 void TerminateProgram()
 {
+    //Other workers may still be reading the ELF files so unwind to the main thread for cleanup
+    if (is_worker_thread) {
+        throw WorkerTerminated();
+    }
     DeleteELFReaders();
     exit(1);
 }
@@ -83,29 +304,112 @@ ELFIO::section* FindELFSection(ELFIO::elfio* reader, std::string name)
     return NULL;
 }
 
-uint32_t FindELFSectionIndex(ELFIO::elfio* reader, std::string name)
+uint32_t FindELFSectionIndex(const ELFFile& file, const std::string& name)
+{
+    auto iter = file.section_indices.find(name);
+    if (iter == file.section_indices.end()) {
+        //Return number of sections
+        return file.reader->sections.size();
+    }
+    return iter->second;
+}
+
+bool IsSectionLive(const ELFFile& file, uint32_t section)
 {
+    //Sections without SHF_ALLOC are never loaded even if the linker script keeps them
+    if (section < file.reader->sections.size() && !(file.reader->sections[section]->get_flags() & ELFIO::SHF_ALLOC)) {
+        return false;
+    }
+    return file.live_sections.empty() || file.live_sections[section];
+}
+
+void NumberCompactSections(ELFFile* file)
+{
+    ELFIO::elfio* reader = file->reader;
+    //Number loaded sections from 1 for compact section tables
+    uint16_t num_compact_sections = 0;
+    file->compact_sections.assign(reader->sections.size(), ELFIO::SHN_UNDEF);
     for (uint32_t i = 0; i < reader->sections.size(); i++) {
-        if (reader->sections[i]->get_name() == name) {
-            //Section name found
-            return i;
+        ELFIO::Elf_Word type = reader->sections[i]->get_type();
+        if ((type == ELFIO::SHT_PROGBITS || type == ELFIO::SHT_NOBITS) && IsSectionLive(*file, i)) {
+            file->compact_sections[i] = ++num_compact_sections;
         }
     }
-    //Return number of sections
-    return reader->sections.size();
+}
+
+uint32_t GetRelocTargetSection(const ELFFile& file, uint32_t rel_section)
+{
+    //Prefer sh_info since section names need not be unique
+    uint32_t target = file.reader->sections[rel_section]->get_info();
+    if (target != ELFIO::SHN_UNDEF && target < file.reader->sections.size()) {
+        return target;
+    }
+    return FindELFSectionIndex(file, file.reader->sections[rel_section]->get_name().substr(4));
+}
+
+void CacheELFMetadata(ELFFile* file)
+{
+    ELFIO::elfio* reader = file->reader;
+    //Map section names to indices
+    file->section_indices.reserve(reader->sections.size());
+    for (uint32_t i = 0; i < reader->sections.size(); i++) {
+        //Keep first section with each name
+        file->section_indices.emplace(reader->sections[i]->get_name(), i);
+    }
+    NumberCompactSections(file);
+    //Index relocation sections by the section they patch
+    file->section_rels.resize(reader->sections.size());
+    for (uint32_t i = 0; i < reader->sections.size(); i++) {
+        if (reader->sections[i]->get_type() == ELFIO::SHT_REL) {
+            uint32_t target = GetRelocTargetSection(*file, i);
+            if (target < reader->sections.size()) {
+                file->section_rels[target].push_back(i);
+            }
+        }
+    }
+    file->uses_shared_module = false;
+    //Decode symbol table
+    ELFIO::symbol_section_accessor sym_accessor(*reader, file->symtab);
+    file->symbols.resize(sym_accessor.get_symbols_num());
+    for (ELFIO::Elf_Xword i = 0; i < file->symbols.size(); i++) {
+        ELFSymbol& symbol = file->symbols[i];
+        ELFIO::Elf64_Addr addr = 0;
+        ELFIO::Elf_Xword size = 0;
+        unsigned char bind = ELFIO::STB_LOCAL;
+        unsigned char type = ELFIO::STT_NOTYPE;
+        ELFIO::Elf_Half section_index = ELFIO::SHN_UNDEF;
+        unsigned char other = 0;
+        if (!sym_accessor.get_symbol(i, symbol.name, addr, size, bind, type, section_index, other)) {
+            std::cout << "Failed to read symbol " << i << " of ELF " << file->orig_path << "." << std::endl;
+            TerminateProgram();
+        }
+        symbol.addr = addr;
+        symbol.bind = bind;
+        symbol.type = type;
+        symbol.section = section_index;
+        //Remember first non-local definition of every name
+        if (section_index != ELFIO::SHN_UNDEF && bind != ELFIO::STB_LOCAL && !symbol.name.empty()) {
+            file->exports.emplace(symbol.name, i);
+        }
+    }
+}
+
+std::string GetModuleName(const std::string& path)
+{
+    //Strip directory and extension
+    size_t slash_pos = path.find_last_of("\\/") + 1;
+    size_t dot_pos = path.find_last_of(".");
+    return path.substr(slash_pos, dot_pos - slash_pos);
 }
 
 void LoadELF(char* path, bool relocatable)
 {
     ELFFile file;
-    std::string temp = path;
     //Construct ELF name
-    size_t slash_pos = temp.find_last_of("\\/") + 1;
-    size_t dot_pos = temp.find_last_of(".");
     file.orig_path = path;
-    file.name = temp.substr(slash_pos, dot_pos - slash_pos);
+    file.name = GetModuleName(path);
     file.reader = new ELFIO::elfio;
-    if (!file.reader->load(path)) {
+    if (!file.reader->load_mapped(path)) {
         std::cout << "Failed to read ELF file " << path << "." << std::endl;
         delete file.reader;
         TerminateProgram();
@@ -135,51 +439,126 @@ void LoadELF(char* path, bool relocatable)
         }
     }
     //Check if ELF has symbols
-    if (!FindELFSection(file.reader, ".symtab")) {
+    file.symtab = FindELFSection(file.reader, ".symtab");
+    if (!file.symtab) {
         std::cout << "ELF " << path << " is stripped." << std::endl;
         delete file.reader;
         TerminateProgram();
     }
-    elf_files.push_back(file);
+    CacheELFMetadata(&file);
+    elf_files.push_back(std::move(file));
 }
 
-bool SearchSymbolELF(std::string name, SymbolSearchResult* result, uint32_t elf_id)
+bool SearchSymbolELF(const std::string& name, SymbolSearchResult* result, uint32_t elf_id)
 {
-    ELFIO::elfio* reader = elf_files[elf_id].reader;
-    ELFIO::section* sym_section = FindELFSection(reader, ".symtab");
-    ELFIO::symbol_section_accessor sym_accessor(*reader, sym_section);
-    //Random variables needed for symbol getter to work
-    ELFIO::Elf64_Addr addr;
-    ELFIO::Elf_Xword size;
-    unsigned char bind;
-    unsigned char type;
-    ELFIO::Elf_Half section_index;
-    unsigned char other;
-    if (!sym_accessor.get_symbol(name, addr, size, bind, type, section_index, other)) {
-        return false;
-    }
-    //Only accept non-local defined symbols
-    if (section_index == ELFIO::SHN_UNDEF || bind == ELFIO::STB_LOCAL) {
+    //Only non-local defined symbols are exported
+    auto iter = elf_files[elf_id].exports.find(name);
+    if (iter == elf_files[elf_id].exports.end()) {
         return false;
     }
     //Write result
-    result->addr = addr;
-    result->section = section_index;
+    const ELFSymbol& symbol = elf_files[elf_id].symbols[iter->second];
+    result->addr = symbol.addr;
+    result->section = symbol.section;
     result->module = elf_id;
     return true;
 }
 
-bool SearchSymbolGlobal(std::string name, SymbolSearchResult* result, uint32_t excluded_elf)
+bool IsModuleLocalSymbol(const std::string& name)
 {
-    //Look for symbol in all elf files but excluded_elf
+    //Module entry points are resolved per module and never exported
+    return name == "_prolog" || name == "_epilog" || name == "_unresolved";
+}
+
+void BuildGlobalSymbolIndex()
+{
+    global_symbols.clear();
     for (uint32_t i = 0; i < elf_files.size(); i++) {
-        if (i != excluded_elf) {
-            if (SearchSymbolELF(name, result, i)) {
-                return true;
+        global_symbols.reserve(global_symbols.size() + elf_files[i].symbols.size());
+        for (uint32_t j = 0; j < elf_files[i].symbols.size(); j++) {
+            const ELFSymbol& elf_symbol = elf_files[i].symbols[j];
+            //Only index non-local defined symbols
+            if (elf_symbol.section == ELFIO::SHN_UNDEF || elf_symbol.bind == ELFIO::STB_LOCAL || elf_symbol.name.empty()) {
+                continue;
+            }
+            if (i != 0 && IsModuleLocalSymbol(elf_symbol.name)) {
+                continue;
+            }
+            GlobalSymbol symbol;
+            symbol.def.addr = elf_symbol.addr;
+            symbol.def.section = elf_symbol.section;
+            symbol.def.module = i;
+            symbol.weak = elf_symbol.bind == ELFIO::STB_WEAK;
+            symbol.duplicate = false;
+            symbol.duplicate_module = 0;
+            auto result = global_symbols.try_emplace(elf_symbol.name, symbol);
+            if (!result.second) {
+                GlobalSymbol& prev = result.first->second;
+                if (prev.weak && !symbol.weak) {
+                    //Strong definitions override weak ones
+                    prev = symbol;
+                }
+                else if (!prev.weak && !symbol.weak && prev.def.module != i && !prev.duplicate) {
+                    //Remember duplicate strong definition for error reporting
+                    prev.duplicate = true;
+                    prev.duplicate_module = i;
+                }
             }
         }
     }
-    return false;
+}
+
+const SymbolSearchResult* SearchSymbolGlobal(const std::string& name, uint32_t excluded_elf)
+{
+    //Look for symbol in all elf files but excluded_elf
+    auto iter = global_symbols.find(name);
+    if (iter == global_symbols.end() || iter->second.def.module == excluded_elf) {
+        return NULL;
+    }
+    if (iter->second.duplicate) {
+        //Refuse to pick between multiple strong definitions
+        std::cout << "multiple definition of '" << name << "' in " << elf_files[iter->second.def.module].orig_path;
+        std::cout << " and " << elf_files[iter->second.duplicate_module].orig_path << std::endl;
+        TerminateProgram();
+    }
+    return &iter->second.def;
+}
+
+bool IsSharedModule(uint32_t elf_id)
+{
+    return shared_module_id != 0 && elf_id == shared_module_id;
+}
+
+uint16_t GetSharedSection(const ELFFile& file, uint32_t section)
+{
+    //Returns the shared module section replacing a hoisted section
+    if (section >= file.shared_indices.size()) {
+        return ELFIO::SHN_UNDEF;
+    }
+    return file.shared_indices[section];
+}
+
+uint16_t GetModuleSectionIndex(uint32_t elf_id, uint16_t section)
+{
+    if (IsSharedModule(elf_id)) {
+        //Shared module sections are numbered from 1 in both formats
+        return section;
+    }
+    if (module_version == MODULE_VERSION_FIXED_RELOCS) {
+        //Fixed relocation modules keep the ELF section numbering
+        return section;
+    }
+    //Sections outside the module and main executable sections are absolute
+    if (elf_id == 0 || section >= elf_files[elf_id].compact_sections.size()) {
+        return ELFIO::SHN_UNDEF;
+    }
+    return elf_files[elf_id].compact_sections[section];
+}
+
+bool IsModuleSectionStored(uint32_t elf_id, uint32_t section)
+{
+    //Compact section tables only keep loaded sections
+    return module_version == MODULE_VERSION_FIXED_RELOCS || elf_files[elf_id].compact_sections[section] != ELFIO::SHN_UNDEF;
 }
 
 void InsertSectionChange(ModuleData* module, uint32_t module_id, uint16_t section)
@@ -196,189 +575,617 @@ void InsertSectionChange(ModuleData* module, uint32_t module_id, uint16_t sectio
         reloc_tmp.section = section;
         reloc_tmp.type = R_ULTRA_SEC;
         reloc_tmp.sym_ofs = 0;
+        reloc_tmp.addend = 0;
         module->imports[module_id].push_back(reloc_tmp);
     }
 }
 
+uint32_t GetBufferU32(const uint8_t* data)
+{
+    return (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+void SetBufferU32(uint8_t* data, uint32_t value)
+{
+    data[0] = value >> 24;
+    data[1] = (value >> 16) & 0xFF;
+    data[2] = (value >> 8) & 0xFF;
+    data[3] = value & 0xFF;
+}
+
+uint32_t ReadSectionU32(const ELFFile& file, uint32_t section, uint32_t offset)
+{
+    ELFIO::section* sec = file.reader->sections[section];
+    if (sec->get_type() != ELFIO::SHT_PROGBITS || offset > sec->get_size() || sec->get_size() - offset < 4) {
+        std::cout << "Relocation at offset 0x" << std::hex << offset << std::dec << " is outside " << sec->get_name();
+        std::cout << " in " << file.orig_path << "." << std::endl;
+        TerminateProgram();
+    }
+    return GetBufferU32((const uint8_t*)sec->get_data() + offset);
+}
+
+void PairHi16Relocs(const ELFFile& file, uint32_t section, const std::vector<ELFRelocation>& relocs, std::vector<int32_t>& addends, std::vector<uint32_t>& lo_offsets)
+{
+    //Walk backwards remembering the next LO16 of each symbol
+    std::unordered_map<ELFIO::Elf_Word, uint32_t> next_lo;
+    addends.assign(relocs.size(), 0);
+    lo_offsets.resize(relocs.size());
+    for (size_t i = 0; i < relocs.size(); i++) {
+        lo_offsets[i] = relocs[i].offset;
+    }
+    for (size_t i = relocs.size(); i-- > 0;) {
+        const ELFRelocation& reloc = relocs[i];
+        if (reloc.type == R_MIPS_LO16) {
+            next_lo[reloc.symbol] = reloc.offset;
+        }
+        else if (reloc.type == R_MIPS_HI16) {
+            //Combine hi with sign-extended lo of its partner
+            int32_t addend = ReadSectionU32(file, section, reloc.offset) << 16;
+            auto lo = next_lo.find(reloc.symbol);
+            if (lo != next_lo.end()) {
+                addend += (int16_t)(ReadSectionU32(file, section, lo->second) & 0xFFFF);
+                lo_offsets[i] = lo->second;
+            }
+            addends[i] = addend;
+        }
+    }
+}
+
 void GenerateImports(ModuleData* module)
 {
-    ELFIO::elfio* reader = elf_files[module->elf_id].reader;
+    const ELFFile& file = elf_files[module->elf_id];
+    ELFIO::elfio* reader = file.reader;
+    //Undefined symbols resolved so far, indexed by symbol table index
+    std::vector<const SymbolSearchResult*> resolved(file.symbols.size(), NULL);
+    std::vector<ELFRelocation> relocs;
+    std::vector<int32_t> hi_addends;
+    std::vector<uint32_t> lo_offsets;
+    std::map<uint32_t, std::vector<PendingReloc>> pending;
     //Iterate through relocation sections
     for (ELFIO::Elf_Xword i = 0; i < reader->sections.size(); i++) {
         if (reader->sections[i]->get_type() == ELFIO::SHT_REL) {
             ELFIO::relocation_section_accessor reloc_accessor(*reader, reader->sections[i]);
             std::string target_section_name = reader->sections[i]->get_name().substr(4);
-            uint32_t target_section_idx = FindELFSectionIndex(reader, target_section_name);
+            uint32_t target_section_idx = GetRelocTargetSection(file, i);
             if (target_section_idx == reader->sections.size()) {
                 std::cout << "Could not find matching section name " << target_section_name << "in ELF." << std::endl;
                 TerminateProgram();
             }
-            for (ELFIO::Elf_Xword j = 0; j < reloc_accessor.get_entries_num(); j++) {
-                //Read relocation
-                ELFIO::Elf64_Addr offset;
-                ELFIO::Elf_Word symbol;
-                unsigned char type;
+            if (!IsSectionLive(file, target_section_idx)) {
+                //Relocations of removed sections are never applied
+                continue;
+            }
+            //Read relocations
+            relocs.resize(reloc_accessor.get_entries_num());
+            for (ELFIO::Elf_Xword j = 0; j < relocs.size(); j++) {
                 ELFIO::Elf_Sxword addend;
-                reloc_accessor.get_entry(j, offset, symbol, type, addend);
-                {
-                    //Read symbol
-                    ELFIO::symbol_section_accessor sym_accessor(*reader, FindELFSection(reader, ".symtab"));
-                    std::string sym_name;
-                    ELFIO::Elf64_Addr sym_addr;
-                    ELFIO::Elf_Xword sym_size;
-                    unsigned char sym_bind;
-                    unsigned char sym_type;
-                    ELFIO::Elf_Half sym_section;
-                    unsigned char other;
-                    sym_accessor.get_symbol(symbol, sym_name, sym_addr, sym_size, sym_bind, sym_type, sym_section, other);
-                    if (sym_section != ELFIO::SHN_UNDEF) {
-                        //Symbol is defined internally
-                        InsertSectionChange(module, module->elf_id, target_section_idx);
-                        //Insert Relocation
-                        RelocRecord reloc_tmp;
-                        reloc_tmp.offset = offset;
-                        reloc_tmp.section = sym_section;
-                        reloc_tmp.type = type;
-                        reloc_tmp.sym_ofs = sym_addr;
-                        module->imports[module->elf_id].push_back(reloc_tmp);
-                    }
-                    else {
-                        //Symbol only defined externally
-                        SymbolSearchResult search_result;
-                        if (!SearchSymbolGlobal(sym_name, &search_result, module->elf_id)) {
+                reloc_accessor.get_entry(j, relocs[j].offset, relocs[j].symbol, relocs[j].type, addend);
+            }
+            PairHi16Relocs(file, target_section_idx, relocs, hi_addends, lo_offsets);
+            for (ELFIO::Elf_Xword j = 0; j < relocs.size(); j++) {
+                ELFIO::Elf64_Addr offset = relocs[j].offset;
+                ELFIO::Elf_Word symbol = relocs[j].symbol;
+                unsigned char type = relocs[j].type;
+                const ELFSymbol& sym = file.symbols[symbol];
+                uint32_t sym_module;
+                uint16_t sym_section;
+                uint32_t sym_addr;
+                if (sym.section != ELFIO::SHN_UNDEF) {
+                    //Symbol is defined internally
+                    sym_module = module->elf_id;
+                    sym_section = sym.section;
+                    sym_addr = sym.addr;
+                }
+                else {
+                    //Symbol only defined externally
+                    if (!resolved[symbol]) {
+                        resolved[symbol] = SearchSymbolGlobal(sym.name, module->elf_id);
+                        if (!resolved[symbol]) {
                             //Throw undefined reference error
                             std::cout << std::setbase(16);
-                            std::cout << elf_files[module->elf_id].orig_path << ":(" << target_section_name << "+0x" << offset << "): ";
-                            std::cout << "undefined reference to '" << sym_name << "'" << std::endl;
+                            std::cout << file.orig_path << ":(" << target_section_name << "+0x" << offset << "): ";
+                            std::cout << "undefined reference to '" << sym.name << "'" << std::endl;
                             TerminateProgram();
                         }
-                        InsertSectionChange(module, search_result.module, target_section_idx);
-                        //Insert Relocation
+                    }
+                    const SymbolSearchResult* search_result = resolved[symbol];
+                    if (search_result->module == 0) {
+                        //Main executable addresses are fixed so patch section data directly
                         RelocRecord reloc_tmp;
                         reloc_tmp.offset = offset;
-                        reloc_tmp.section = search_result.section;
+                        reloc_tmp.section = target_section_idx;
                         reloc_tmp.type = type;
-                        reloc_tmp.sym_ofs = search_result.addr;
-                        module->imports[search_result.module].push_back(reloc_tmp);
+                        reloc_tmp.sym_ofs = search_result->addr;
+                        reloc_tmp.addend = hi_addends[j];
+                        module->static_relocs.push_back(reloc_tmp);
+                        if (collect_module_stats) {
+                            module->stats.symbol_imports[sym.name]++;
+                        }
+                        continue;
                     }
+                    sym_module = search_result->module;
+                    sym_section = search_result->section;
+                    sym_addr = search_result->addr;
+                }
+                if (collect_module_stats && sym.section == ELFIO::SHN_UNDEF) {
+                    module->stats.symbol_imports[sym.name]++;
                 }
+                //Hoisted sections are imported from the shared module instead
+                uint16_t shared_section = GetSharedSection(elf_files[sym_module], sym_section);
+                if (shared_section != ELFIO::SHN_UNDEF) {
+                    sym_module = shared_module_id;
+                    sym_section = shared_section;
+                }
+                //Queue relocation for sorting
+                PendingReloc pending_tmp;
+                pending_tmp.target_section = target_section_idx;
+                pending_tmp.sort_offset = offset;
+                if (module_version == MODULE_VERSION_FIXED_RELOCS) {
+                    //Fixed format loaders pair HI16 with the next LO16 so keep it just before its partner
+                    pending_tmp.sort_offset = lo_offsets[j];
+                }
+                pending_tmp.reloc.offset = offset;
+                pending_tmp.reloc.section = sym_section;
+                pending_tmp.reloc.type = type;
+                pending_tmp.reloc.sym_ofs = sym_addr;
+                pending_tmp.reloc.addend = hi_addends[j];
+                pending[sym_module].push_back(pending_tmp);
+            }
+        }
+    }
+    //Sort by patched section and offset so every section is switched to once and writes only move forward
+    for (std::pair<const uint32_t, std::vector<PendingReloc>>& import : pending) {
+        std::stable_sort(import.second.begin(), import.second.end(), [](const PendingReloc& a, const PendingReloc& b) {
+            if (a.target_section != b.target_section) {
+                return a.target_section < b.target_section;
             }
+            return a.sort_offset < b.sort_offset;
+        });
+        for (const PendingReloc& reloc : import.second) {
+            InsertSectionChange(module, import.first, reloc.target_section);
+            module->imports[import.first].push_back(reloc.reloc);
         }
     }
 }
 
-void ReadModule(uint32_t elf_id)
+bool IsRemovableSection(const std::string& name)
 {
-    ModuleData module;
-    SymbolSearchResult sym_result;
-    module.elf_id = elf_id;
-    module.name = elf_files[elf_id].name;
-    GenerateImports(&module);
-    module.ctor_section = FindELFSectionIndex(elf_files[elf_id].reader, ".ctors");
-    if (module.ctor_section == elf_files[elf_id].reader->sections.size()) {
-        module.ctor_section = ELFIO::SHN_UNDEF;
+    //Only sections from -ffunction-sections, -fdata-sections and linkonce groups hold a single function or object
+    static const char* prefixes[] = { ".text.", ".rodata.", ".data.", ".bss.", ".sdata.", ".sbss.", ".gnu.linkonce." };
+    for (const char* prefix : prefixes) {
+        if (name.compare(0, strlen(prefix), prefix) == 0) {
+            return true;
+        }
     }
-    module.dtor_section = FindELFSectionIndex(elf_files[elf_id].reader, ".dtors");
-    if (module.dtor_section == elf_files[elf_id].reader->sections.size()) {
-        module.dtor_section = ELFIO::SHN_UNDEF;
+    return false;
+}
+
+void MarkSectionLive(std::vector<std::pair<uint32_t, uint32_t>>& worklist, uint32_t elf_id, uint32_t section)
+{
+    ELFFile& file = elf_files[elf_id];
+    //Main executable sections are always present
+    if (elf_id == 0 || section >= file.live_sections.size() || file.live_sections[section]) {
+        return;
     }
-    //Look for prolog symbol
-    if (SearchSymbolELF("_prolog", &sym_result, elf_id)) {
-        module.prolog_section = sym_result.section;
-        module.prolog_addr = sym_result.addr;
+    file.live_sections[section] = true;
+    worklist.emplace_back(elf_id, section);
+}
+
+void ReadPrelinkFile(const std::string& path)
+{
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) {
+        std::cout << "Failed to open prelink file " << path << "." << std::endl;
+        TerminateProgram();
     }
-    else {
-        //Symbol not found
-        module.prolog_section = ELFIO::SHN_UNDEF;
-        module.prolog_addr = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), file)) {
+        //Entries are a module name and hex address, # starts a comment
+        //Saved ModulePrintLoadedList output also works since its header and other lines are skipped
+        std::string text = line;
+        std::istringstream fields(text.substr(0, text.find('#')));
+        std::string name;
+        std::string addr;
+        std::string extra;
+        if (!(fields >> name >> addr) || (fields >> extra)) {
+            continue;
+        }
+        //Accept the (start-end) range ModulePrintLoadedList prints
+        bool range = addr.front() == '(';
+        if (range && (addr.back() != ')' || addr.find('-') == std::string::npos)) {
+            continue;
+        }
+        const char* start = addr.c_str() + (range ? 1 : 0);
+        char* end = NULL;
+        uint32_t value = strtoul(start, &end, 16);
+        if (end == start || *end != (range ? '-' : '\0') || value == 0) {
+            continue;
+        }
+        prelink_addrs[name] = value;
     }
-    //Look for epilog symbol
-    if (SearchSymbolELF("_epilog", &sym_result, elf_id)) {
-        module.epilog_section = sym_result.section;
-        module.epilog_addr = sym_result.addr;
-    } else {
-        //Symbol not found
-        module.epilog_section = ELFIO::SHN_UNDEF;
-        module.epilog_addr = 0;
+    fclose(file);
+}
+
+void ReadKeptSymbols(const std::string& path)
+{
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) {
+        std::cout << "Failed to open symbol list " << path << "." << std::endl;
+        TerminateProgram();
     }
-    //Look for unresolved symbol
-    if (SearchSymbolELF("_unresolved", &sym_result, elf_id)) {
-        module.unresolved_section = sym_result.section;
-        module.unresolved_addr = sym_result.addr;
-    } else {
-        //Symbol not found
-        module.unresolved_section = ELFIO::SHN_UNDEF;
-        module.unresolved_addr = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), file)) {
+        //Whitespace separated symbol names, # starts a comment
+        std::string text = line;
+        std::istringstream names(text.substr(0, text.find('#')));
+        std::string name;
+        while (names >> name) {
+            kept_symbols.insert(name);
+        }
     }
-    //Add module
-    modules_data.push_back(module);
+    fclose(file);
 }
 
-std::filesystem::path GetModulePath(uint32_t module_id)
+void RemoveDeadSections()
 {
-    std::filesystem::path path = std::filesystem::temp_directory_path();
-    path += "/";
-    path += modules_data[module_id].name;
-    path += ".rel";
-    return path;
+    std::vector<std::pair<uint32_t, uint32_t>> worklist;
+    for (uint32_t i = 1; i < elf_files.size(); i++) {
+        elf_files[i].live_sections.assign(elf_files[i].reader->sections.size(), false);
+    }
+    //Roots are sections that are not per-function and the module entry points
+    for (uint32_t i = 1; i < elf_files.size(); i++) {
+        ELFIO::elfio* reader = elf_files[i].reader;
+        for (uint32_t j = 0; j < reader->sections.size(); j++) {
+            ELFIO::Elf_Word type = reader->sections[j]->get_type();
+            bool alloc = reader->sections[j]->get_flags() & ELFIO::SHF_ALLOC;
+            if ((type == ELFIO::SHT_PROGBITS || type == ELFIO::SHT_NOBITS) && alloc && !IsRemovableSection(reader->sections[j]->get_name())) {
+                MarkSectionLive(worklist, i, j);
+            }
+        }
+        for (const char* name : { "_prolog", "_epilog", "_unresolved" }) {
+            SymbolSearchResult sym_result;
+            if (SearchSymbolELF(name, &sym_result, i)) {
+                MarkSectionLive(worklist, i, sym_result.section);
+            }
+        }
+        //Symbols only found through ModuleGetSymbol have no relocations keeping them
+        for (const std::string& name : kept_symbols) {
+            SymbolSearchResult sym_result;
+            if (SearchSymbolELF(name, &sym_result, i)) {
+                MarkSectionLive(worklist, i, sym_result.section);
+            }
+        }
+    }
+    //Follow relocations out of every live section
+    while (!worklist.empty()) {
+        uint32_t elf_id = worklist.back().first;
+        uint32_t section = worklist.back().second;
+        worklist.pop_back();
+        const ELFFile& file = elf_files[elf_id];
+        for (uint32_t rel_section : file.section_rels[section]) {
+            ELFIO::relocation_section_accessor reloc_accessor(*file.reader, file.reader->sections[rel_section]);
+            for (ELFIO::Elf_Xword i = 0; i < reloc_accessor.get_entries_num(); i++) {
+                ELFIO::Elf64_Addr offset;
+                ELFIO::Elf_Word symbol;
+                unsigned char type;
+                ELFIO::Elf_Sxword addend;
+                reloc_accessor.get_entry(i, offset, symbol, type, addend);
+                const ELFSymbol& sym = file.symbols[symbol];
+                if (sym.section != ELFIO::SHN_UNDEF) {
+                    MarkSectionLive(worklist, elf_id, sym.section);
+                    continue;
+                }
+                //Import generation reports missing and duplicate symbols
+                auto iter = global_symbols.find(sym.name);
+                if (iter != global_symbols.end() && !iter->second.duplicate) {
+                    MarkSectionLive(worklist, iter->second.def.module, iter->second.def.section);
+                }
+            }
+        }
+    }
+    //Renumber compact section tables and report savings
+    for (uint32_t i = 1; i < elf_files.size(); i++) {
+        ELFFile& file = elf_files[i];
+        ELFIO::elfio* reader = file.reader;
+        NumberCompactSections(&file);
+        uint32_t num_removed = 0;
+        uint64_t removed_size = 0;
+        uint64_t removed_noload_size = 0;
+        for (uint32_t j = 0; j < reader->sections.size(); j++) {
+            ELFIO::Elf_Word type = reader->sections[j]->get_type();
+            bool alloc = reader->sections[j]->get_flags() & ELFIO::SHF_ALLOC;
+            if ((type == ELFIO::SHT_PROGBITS || type == ELFIO::SHT_NOBITS) && alloc && !file.live_sections[j]) {
+                num_removed++;
+                if (type == ELFIO::SHT_PROGBITS) {
+                    removed_size += reader->sections[j]->get_size();
+                }
+                else {
+                    removed_noload_size += reader->sections[j]->get_size();
+                }
+            }
+        }
+        if (num_removed != 0) {
+            std::cout << file.name << ": removed " << num_removed << " unused sections (";
+            std::cout << removed_size << " bytes of data, " << removed_noload_size << " bytes of BSS)" << std::endl;
+        }
+    }
 }
 
-void WriteU8(FILE* file, uint8_t value)
+bool IsShareableSection(const ELFFile& file, uint32_t section)
 {
-    //Forward value to fwrite
-    fwrite(&value, 1, 1, file);
+    ELFIO::section* sec = file.reader->sections[section];
+    //Writable data must stay private to each module
+    if (sec->get_type() != ELFIO::SHT_PROGBITS || (sec->get_flags() & ELFIO::SHF_WRITE) || !(sec->get_flags() & ELFIO::SHF_ALLOC) || sec->get_size() == 0) {
+        return false;
+    }
+    //Merged constants, linkonce groups and per-function sections
+    return (sec->get_flags() & ELFIO::SHF_MERGE) || IsRemovableSection(sec->get_name());
 }
 
-void WriteU16(FILE* file, uint16_t value)
+bool GetMainRelocs(const ELFFile& file, uint32_t section, std::vector<RelocRecord>& relocs)
 {
-    //Write in big-endian order
-    uint8_t bytes[2];
-    bytes[0] = value >> 8;
-    bytes[1] = value & 0xFF;
-    fwrite(&bytes, 1, 2, file);
+    std::vector<ELFRelocation> elf_relocs;
+    std::vector<int32_t> hi_addends;
+    std::vector<uint32_t> lo_offsets;
+    relocs.clear();
+    for (uint32_t rel_section : file.section_rels[section]) {
+        ELFIO::relocation_section_accessor reloc_accessor(*file.reader, file.reader->sections[rel_section]);
+        elf_relocs.resize(reloc_accessor.get_entries_num());
+        for (ELFIO::Elf_Xword i = 0; i < elf_relocs.size(); i++) {
+            ELFIO::Elf_Sxword addend;
+            reloc_accessor.get_entry(i, elf_relocs[i].offset, elf_relocs[i].symbol, elf_relocs[i].type, addend);
+        }
+        PairHi16Relocs(file, section, elf_relocs, hi_addends, lo_offsets);
+        for (size_t i = 0; i < elf_relocs.size(); i++) {
+            //Only main executable targets have the same address in every copy
+            const ELFSymbol& sym = file.symbols[elf_relocs[i].symbol];
+            if (sym.section != ELFIO::SHN_UNDEF) {
+                return false;
+            }
+            auto iter = global_symbols.find(sym.name);
+            if (iter == global_symbols.end() || iter->second.duplicate || iter->second.def.module != 0) {
+                return false;
+            }
+            RelocRecord reloc_tmp;
+            reloc_tmp.offset = elf_relocs[i].offset;
+            reloc_tmp.section = section;
+            reloc_tmp.type = elf_relocs[i].type;
+            reloc_tmp.sym_ofs = iter->second.def.addr;
+            reloc_tmp.addend = hi_addends[i];
+            relocs.push_back(reloc_tmp);
+        }
+    }
+    return true;
 }
 
-void WriteU32(FILE* file, uint32_t value)
+bool GetSharedSectionKey(const ELFFile& file, uint32_t section, std::string* key)
 {
-    //Write in big-endian order
-    uint8_t bytes[4];
-    bytes[0] = value >> 24;
-    bytes[1] = (value >> 16) & 0xFF;
-    bytes[2] = (value >> 8) & 0xFF;
-    bytes[3] = value & 0xFF;
-    fwrite(&bytes, 1, 4, file);
+    ELFIO::section* sec = file.reader->sections[section];
+    std::vector<RelocRecord> relocs;
+    if (!GetMainRelocs(file, section, relocs)) {
+        return false;
+    }
+    //Copies must match in flags, alignment, contents and relocations
+    uint32_t attributes[3] = { (uint32_t)sec->get_flags(), (uint32_t)sec->get_addr_align(), (uint32_t)sec->get_size() };
+    key->assign((const char*)attributes, sizeof(attributes));
+    key->append(sec->get_data(), sec->get_size());
+    for (const RelocRecord& reloc : relocs) {
+        uint32_t values[3] = { reloc.offset, reloc.type, reloc.sym_ofs };
+        key->append((const char*)values, sizeof(values));
+    }
+    return true;
 }
 
-struct ModuleHeader {
-    uint32_t num_sections;
-    uint32_t section_info_ofs;
-    uint32_t num_import_modules;
+void ShareDuplicateSections()
+{
+    //Group identical shareable sections, keeping module order within each group
+    std::map<std::string, uint32_t> group_indices;
+    std::vector<std::vector<std::pair<uint32_t, uint32_t>>> groups;
+    std::string key;
+    for (uint32_t i = 1; i < elf_files.size(); i++) {
+        const ELFFile& file = elf_files[i];
+        ELFIO::elfio* reader = file.reader;
+        if (file.name == SHARED_MODULE_NAME) {
+            std::cout << "Module name " << SHARED_MODULE_NAME << " is reserved for shared sections." << std::endl;
+            TerminateProgram();
+        }
+        //Module entry points must stay in their own module
+        std::vector<bool> entry_sections(reader->sections.size(), false);
+        for (const char* name : { "_prolog", "_epilog", "_unresolved" }) {
+            SymbolSearchResult sym_result;
+            if (SearchSymbolELF(name, &sym_result, i) && sym_result.section < entry_sections.size()) {
+                entry_sections[sym_result.section] = true;
+            }
+        }
+        for (uint32_t j = 0; j < reader->sections.size(); j++) {
+            if (!IsSectionLive(file, j) || entry_sections[j] || !IsShareableSection(file, j) || !GetSharedSectionKey(file, j, &key)) {
+                continue;
+            }
+            auto result = group_indices.try_emplace(key, groups.size());
+            if (result.second) {
+                groups.emplace_back();
+            }
+            groups[result.first->second].emplace_back(i, j);
+        }
+    }
+    //Hoist every group with copies in more than one module
+    uint32_t num_copies = 0;
+    uint64_t duplicate_size = 0;
+    for (const std::vector<std::pair<uint32_t, uint32_t>>& group : groups) {
+        if (group.front().first == group.back().first) {
+            continue;
+        }
+        SharedSection shared;
+        shared.elf_id = group.front().first;
+        shared.section = group.front().second;
+        shared.num_copies = group.size();
+        shared_sections.push_back(shared);
+        for (const std::pair<uint32_t, uint32_t>& copy : group) {
+            ELFFile& file = elf_files[copy.first];
+            if (file.shared_indices.empty()) {
+                file.shared_indices.assign(file.reader->sections.size(), ELFIO::SHN_UNDEF);
+            }
+            if (file.live_sections.empty()) {
+                file.live_sections.assign(file.reader->sections.size(), true);
+            }
+            //Hoisted copies are stored like removed sections
+            file.shared_indices[copy.second] = shared_sections.size();
+            file.live_sections[copy.second] = false;
+            file.uses_shared_module = true;
+        }
+        num_copies += group.size();
+        duplicate_size += elf_files[shared.elf_id].reader->sections[shared.section]->get_size() * (group.size() - 1);
+    }
+    if (shared_sections.empty()) {
+        return;
+    }
+    shared_module_id = elf_files.size();
+    for (uint32_t i = 1; i < elf_files.size(); i++) {
+        ELFFile& file = elf_files[i];
+        //Modules linking to hoisted symbols of other modules need the shared module too
+        for (uint32_t j = 0; j < file.symbols.size() && !file.uses_shared_module; j++) {
+            const ELFSymbol& symbol = file.symbols[j];
+            if (symbol.section != ELFIO::SHN_UNDEF || symbol.name.empty()) {
+                continue;
+            }
+            auto iter = global_symbols.find(symbol.name);
+            if (iter != global_symbols.end() && !iter->second.duplicate && GetSharedSection(elf_files[iter->second.def.module], iter->second.def.section) != ELFIO::SHN_UNDEF) {
+                file.uses_shared_module = true;
+            }
+        }
+        //Compact section tables leave out hoisted sections
+        if (!file.shared_indices.empty()) {
+            NumberCompactSections(&file);
+        }
+    }
+    std::cout << SHARED_MODULE_NAME << ": shared " << shared_sections.size() << " sections from " << num_copies << " copies (";
+    std::cout << duplicate_size << " bytes of duplicates)" << std::endl;
+}
+
+void ReadModule(uint32_t elf_id, uint32_t module_id)
+{
+    ModuleData module;
+    SymbolSearchResult sym_result;
+    module.elf_id = elf_id;
+    module.name = elf_files[elf_id].name;
+    GenerateImports(&module);
+    module.ctor_section = FindELFSectionIndex(elf_files[elf_id], ".ctors");
+    if (module.ctor_section == elf_files[elf_id].reader->sections.size()) {
+        module.ctor_section = ELFIO::SHN_UNDEF;
+    }
+    module.dtor_section = FindELFSectionIndex(elf_files[elf_id], ".dtors");
+    if (module.dtor_section == elf_files[elf_id].reader->sections.size()) {
+        module.dtor_section = ELFIO::SHN_UNDEF;
+    }
+    //Look for prolog symbol
+    if (SearchSymbolELF("_prolog", &sym_result, elf_id)) {
+        module.prolog_section = sym_result.section;
+        module.prolog_addr = sym_result.addr;
+    }
+    else {
+        //Symbol not found
+        module.prolog_section = ELFIO::SHN_UNDEF;
+        module.prolog_addr = 0;
+    }
+    //Look for epilog symbol
+    if (SearchSymbolELF("_epilog", &sym_result, elf_id)) {
+        module.epilog_section = sym_result.section;
+        module.epilog_addr = sym_result.addr;
+    } else {
+        //Symbol not found
+        module.epilog_section = ELFIO::SHN_UNDEF;
+        module.epilog_addr = 0;
+    }
+    //Look for unresolved symbol
+    if (SearchSymbolELF("_unresolved", &sym_result, elf_id)) {
+        module.unresolved_section = sym_result.section;
+        module.unresolved_addr = sym_result.addr;
+    } else {
+        //Symbol not found
+        module.unresolved_section = ELFIO::SHN_UNDEF;
+        module.unresolved_addr = 0;
+    }
+    //Add module
+    modules_data[module_id] = module;
+}
+
+void WriteU8(std::vector<uint8_t>& buf, uint8_t value)
+{
+    buf.push_back(value);
+}
+
+void WriteU16(std::vector<uint8_t>& buf, uint16_t value)
+{
+    //Write in big-endian order
+    buf.push_back(value >> 8);
+    buf.push_back(value & 0xFF);
+}
+
+void WriteU32(std::vector<uint8_t>& buf, uint32_t value)
+{
+    //Write in big-endian order
+    buf.push_back(value >> 24);
+    buf.push_back((value >> 16) & 0xFF);
+    buf.push_back((value >> 8) & 0xFF);
+    buf.push_back(value & 0xFF);
+}
+
+void WriteBytes(std::vector<uint8_t>& buf, const void* data, size_t size)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    buf.insert(buf.end(), bytes, bytes + size);
+}
+
+void WriteULEB(std::vector<uint8_t>& buf, uint64_t value)
+{
+    //Write 7 bits at a time with continuation bit
+    do {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        if (value != 0) {
+            byte |= 0x80;
+        }
+        buf.push_back(byte);
+    } while (value != 0);
+}
+
+uint32_t ZigZag(int32_t value)
+{
+    //Map small negative values to small unsigned values
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+struct ModuleHeader {
+    uint32_t num_sections;
+    uint32_t section_info_ofs;
+    uint32_t num_import_modules;
     uint32_t import_modules_ofs;
     uint16_t ctor_section;
     uint16_t dtor_section;
     uint16_t prolog_section;
     uint16_t epilog_section;
     uint16_t unresolved_section;
+    uint16_t version;
     uint32_t prolog_ofs;
     uint32_t epilog_ofs;
     uint32_t unresolved_ofs;
 };
 
-void WriteHeader(FILE* file, ModuleHeader* header)
+void WriteHeader(std::vector<uint8_t>& buf, ModuleHeader* header)
 {
-    WriteU32(file, header->num_sections);
-    WriteU32(file, header->section_info_ofs);
-    WriteU32(file, header->num_import_modules);
-    WriteU32(file, header->import_modules_ofs);
-    WriteU16(file, header->ctor_section);
-    WriteU16(file, header->dtor_section);
-    WriteU16(file, header->prolog_section);
-    WriteU16(file, header->epilog_section);
-    WriteU16(file, header->unresolved_section);
-    WriteU16(file, 0);
-    WriteU32(file, header->prolog_ofs);
-    WriteU32(file, header->epilog_ofs);
-    WriteU32(file, header->unresolved_ofs);
+    WriteU32(buf, header->num_sections);
+    WriteU32(buf, header->section_info_ofs);
+    WriteU32(buf, header->num_import_modules);
+    WriteU32(buf, header->import_modules_ofs);
+    WriteU16(buf, header->ctor_section);
+    WriteU16(buf, header->dtor_section);
+    WriteU16(buf, header->prolog_section);
+    WriteU16(buf, header->epilog_section);
+    WriteU16(buf, header->unresolved_section);
+    WriteU16(buf, header->version);
+    WriteU32(buf, header->prolog_ofs);
+    WriteU32(buf, header->epilog_ofs);
+    WriteU32(buf, header->unresolved_ofs);
 }
 
 uint32_t AlignU32(uint32_t val, uint32_t to)
@@ -387,126 +1194,634 @@ uint32_t AlignU32(uint32_t val, uint32_t to)
     return (val + to - 1) & ~(to - 1);
 }
 
-void AlignFile(FILE* file, uint32_t to)
+void AlignBuffer(std::vector<uint8_t>& buf, uint32_t to)
 {
     //Only supports power of 2 alignment
-    long pos = ftell(file);
-    while (pos & (to - 1)) {
-        WriteU8(file, 0);
-        pos++;
+    buf.resize(AlignU32(buf.size(), to), 0);
+}
+
+uint8_t GetCompactRelocType(const ModuleData& module, uint8_t type)
+{
+    switch (type) {
+        case R_MIPS_32:
+            return 0;
+
+        case R_MIPS_26:
+            return 1;
+
+        case R_MIPS_HI16:
+            return 2;
+
+        case R_MIPS_LO16:
+            return 3;
+
+        default:
+            std::cout << "Unsupported relocation type " << (uint32_t)type << " in " << elf_files[module.elf_id].orig_path << "." << std::endl;
+            TerminateProgram();
+            return 0;
     }
 }
 
-void WriteModuleTemp(uint32_t module_id)
+uint32_t EncodeFixedRelocs(std::vector<uint8_t>& buf, const std::vector<RelocRecord>& relocs)
 {
-    ELFIO::elfio* reader = elf_files[modules_data[module_id].elf_id].reader;
-    FILE* file = fopen(GetModulePath(module_id).string().c_str(), "wb");
+    for (uint32_t i = 0; i < relocs.size(); i++) {
+        WriteU32(buf, relocs[i].offset);
+        WriteU8(buf, relocs[i].type);
+        WriteU8(buf, 0);
+        WriteU16(buf, relocs[i].section);
+        WriteU32(buf, relocs[i].sym_ofs);
+    }
+    return relocs.size();
+}
+
+uint32_t EncodeCompactRelocs(std::vector<uint8_t>& buf, const ModuleData& module, uint32_t target_elf, const std::vector<RelocRecord>& relocs)
+{
+    uint16_t sym_section = ELFIO::SHN_UNDEF;
+    uint32_t sym_ofs = 0;
+    uint32_t num_relocs = 0;
+    size_t i = 0;
+    while (i < relocs.size()) {
+        //Every section change starts a run of relocations patching that section
+        if (relocs[i].type != R_ULTRA_SEC) {
+            std::cout << "Relocation list of " << module.name << " does not start with a section." << std::endl;
+            TerminateProgram();
+        }
+        uint16_t section = GetModuleSectionIndex(module.elf_id, relocs[i].section);
+        size_t run_end = ++i;
+        while (run_end < relocs.size() && relocs[run_end].type != R_ULTRA_SEC) {
+            run_end++;
+        }
+        if (run_end == i) {
+            continue;
+        }
+        WriteULEB(buf, section);
+        WriteULEB(buf, run_end - i);
+        //Offsets are stored as word deltas from the previous relocation in the run
+        uint32_t offset = 0;
+        for (; i < run_end; i++) {
+            const RelocRecord& reloc = relocs[i];
+            if (reloc.offset & 0x3) {
+                std::cout << "Unaligned relocation at offset 0x" << std::hex << reloc.offset << std::dec;
+                std::cout << " in " << elf_files[module.elf_id].orig_path << "." << std::endl;
+                TerminateProgram();
+            }
+            uint16_t target_section = GetModuleSectionIndex(target_elf, reloc.section);
+            int32_t delta = (int32_t)(reloc.offset - offset) >> 2;
+            uint64_t head = ((uint64_t)ZigZag(delta) << RELOC_FLAG_BITS) | GetCompactRelocType(module, reloc.type);
+            //Only store symbol location when it changes
+            if (target_section != sym_section) {
+                head |= RELOC_NEW_SECTION;
+            }
+            if (reloc.sym_ofs != sym_ofs) {
+                head |= RELOC_NEW_SYM_OFS;
+            }
+            WriteULEB(buf, head);
+            if (head & RELOC_NEW_SECTION) {
+                WriteULEB(buf, target_section);
+            }
+            if (head & RELOC_NEW_SYM_OFS) {
+                WriteULEB(buf, ZigZag(reloc.sym_ofs - sym_ofs));
+            }
+            if (reloc.type == R_MIPS_HI16) {
+                //HI16 carries its paired addend so the loader never scans for LO16
+                WriteULEB(buf, ZigZag(reloc.addend));
+            }
+            offset = reloc.offset;
+            sym_section = target_section;
+            sym_ofs = reloc.sym_ofs;
+            num_relocs++;
+        }
+    }
+    //Terminate with section 0
+    WriteULEB(buf, ELFIO::SHN_UNDEF);
+    return num_relocs;
+}
+
+uint32_t GetModuleAlign(uint32_t module_id);
+uint32_t GetNoloadAlign(uint32_t module_id);
+
+uint32_t GetPrelinkAddress(uint32_t module_id)
+{
+    //Only compact self relocations can be moved from a preferred address
+    if (module_version != MODULE_VERSION_COMPACT_RELOCS || IsSharedModule(modules_data[module_id].elf_id)) {
+        return 0;
+    }
+    auto iter = prelink_addrs.find(elf_files[modules_data[module_id].elf_id].name);
+    if (iter == prelink_addrs.end()) {
+        return 0;
+    }
+    //Loader allocates with the biggest of the cache line, module and BSS alignment
+    uint32_t align = std::max<uint32_t>(16, std::max(GetModuleAlign(module_id), GetNoloadAlign(module_id)));
+    if (iter->second & (align - 1)) {
+        std::cout << "Prelink address 0x" << std::hex << iter->second << std::dec << " of module " << iter->first;
+        std::cout << " is not aligned to " << align << " bytes." << std::endl;
+        TerminateProgram();
+    }
+    return iter->second;
+}
+
+void ApplyStaticRelocs(std::vector<uint8_t>& buf, const ModuleData& module, const std::vector<RelocRecord>& relocs, const std::vector<uint32_t>& section_ofs)
+{
+    ELFIO::elfio* reader = elf_files[module.elf_id].reader;
+    for (uint32_t i = 0; i < relocs.size(); i++) {
+        const RelocRecord& reloc = relocs[i];
+        ELFIO::section* section = reader->sections[reloc.section];
+        if (section->get_type() != ELFIO::SHT_PROGBITS || (reloc.offset & 0x3) || reloc.offset + 4 > section->get_size()) {
+            std::cout << "Invalid relocation at offset 0x" << std::hex << reloc.offset << std::dec;
+            std::cout << " in " << elf_files[module.elf_id].orig_path << "." << std::endl;
+            TerminateProgram();
+        }
+        uint8_t* ptr = &buf[section_ofs[reloc.section] + reloc.offset];
+        uint32_t value = GetBufferU32(ptr);
+        switch (reloc.type) {
+            case R_MIPS_32:
+                value += reloc.sym_ofs;
+                break;
+
+            case R_MIPS_26:
+            {
+                //Jump targets keep the segment of the instruction so only the low 28 bits matter
+                uint32_t target = ((value & 0x3FFFFFF) << 2) + reloc.sym_ofs;
+                value = (value & 0xFC000000) | ((target & 0xFFFFFFC) >> 2);
+            }
+                break;
+
+            case R_MIPS_HI16:
+            {
+                uint32_t addr = reloc.addend + reloc.sym_ofs;
+                value = (value & 0xFFFF0000) | (((addr + 0x8000) >> 16) & 0xFFFF);
+            }
+                break;
+
+            case R_MIPS_LO16:
+                value = (value & 0xFFFF0000) | ((value + reloc.sym_ofs) & 0xFFFF);
+                break;
+
+            default:
+                std::cout << "Unsupported relocation type " << (uint32_t)reloc.type << " in " << elf_files[module.elf_id].orig_path << "." << std::endl;
+                TerminateProgram();
+                break;
+        }
+        SetBufferU32(ptr, value);
+    }
+}
+
+void AddSelfStaticRelocs(const ModuleData& module, const std::vector<uint32_t>& image_ofs, uint32_t prelink_addr, uint32_t prelink_bss, std::vector<RelocRecord>& static_relocs)
+{
+    ELFIO::elfio* reader = elf_files[module.elf_id].reader;
+    auto iter = module.imports.find(module.elf_id);
+    if (iter == module.imports.end()) {
+        return;
+    }
+    uint16_t section = ELFIO::SHN_UNDEF;
+    for (const RelocRecord& reloc : iter->second) {
+        if (reloc.type == R_ULTRA_SEC) {
+            section = reloc.section;
+            continue;
+        }
+        RelocRecord reloc_tmp = reloc;
+        reloc_tmp.section = section;
+        if (GetModuleSectionIndex(module.elf_id, reloc.section) != ELFIO::SHN_UNDEF) {
+            //Pre-add offset from module or BSS base, HI16 keeps it in its addend instead unless prelinked
+            if (reloc.type == R_MIPS_HI16 && prelink_addr == 0) {
+                continue;
+            }
+            reloc_tmp.sym_ofs += image_ofs[reloc.section];
+            //Prelinked modules also pre-add the preferred module or BSS base
+            if (reader->sections[reloc.section]->get_type() == ELFIO::SHT_NOBITS) {
+                reloc_tmp.sym_ofs += prelink_bss;
+            }
+            else {
+                reloc_tmp.sym_ofs += prelink_addr;
+            }
+        }
+        static_relocs.push_back(reloc_tmp);
+    }
+}
+
+uint32_t EncodeSelfRelocs(std::vector<uint8_t>& buf, const ModuleData& module, const std::vector<uint32_t>& image_ofs, const std::vector<RelocRecord>& relocs)
+{
+    ELFIO::elfio* reader = elf_files[module.elf_id].reader;
+    uint32_t num_relocs = 0;
+    size_t i = 0;
+    while (i < relocs.size()) {
+        uint16_t section = GetModuleSectionIndex(module.elf_id, relocs[i].section);
+        size_t run_end = ++i;
+        uint32_t run_count = 0;
+        while (run_end < relocs.size() && relocs[run_end].type != R_ULTRA_SEC) {
+            //Absolute targets were fully applied at build time
+            if (GetModuleSectionIndex(module.elf_id, relocs[run_end].section) != ELFIO::SHN_UNDEF) {
+                run_count++;
+            }
+            run_end++;
+        }
+        if (run_count == 0) {
+            i = run_end;
+            continue;
+        }
+        WriteULEB(buf, section);
+        WriteULEB(buf, run_count);
+        uint32_t offset = 0;
+        for (; i < run_end; i++) {
+            const RelocRecord& reloc = relocs[i];
+            if (GetModuleSectionIndex(module.elf_id, reloc.section) == ELFIO::SHN_UNDEF) {
+                continue;
+            }
+            if (reloc.offset & 0x3) {
+                std::cout << "Unaligned relocation at offset 0x" << std::hex << reloc.offset << std::dec;
+                std::cout << " in " << elf_files[module.elf_id].orig_path << "." << std::endl;
+                TerminateProgram();
+            }
+            int32_t delta = (int32_t)(reloc.offset - offset) >> 2;
+            uint64_t head = ((uint64_t)ZigZag(delta) << RELOC_SELF_FLAG_BITS) | GetCompactRelocType(module, reloc.type);
+            if (reader->sections[reloc.section]->get_type() == ELFIO::SHT_NOBITS) {
+                head |= RELOC_SELF_BSS;
+            }
+            WriteULEB(buf, head);
+            if (reloc.type == R_MIPS_HI16) {
+                WriteULEB(buf, ZigZag(reloc.addend + image_ofs[reloc.section] + reloc.sym_ofs));
+            }
+            offset = reloc.offset;
+            num_relocs++;
+        }
+    }
+    //Terminate with section 0
+    WriteULEB(buf, ELFIO::SHN_UNDEF);
+    return num_relocs;
+}
+
+void WriteModule(uint32_t module_id)
+{
+    const ModuleData& module = modules_data[module_id];
+    ELFIO::elfio* reader = elf_files[module.elf_id].reader;
+    std::vector<uint8_t>& buf = modules_data[module_id].blob;
     ModuleHeader header;
 
     //Write initial header
-    header.num_sections = reader->sections.size();
+    header.num_sections = 0;
+    for (uint32_t i = 0; i < reader->sections.size(); i++) {
+        if (IsModuleSectionStored(module.elf_id, i)) {
+            header.num_sections++;
+        }
+    }
     header.section_info_ofs = sizeof(ModuleHeader);
-    header.num_import_modules = modules_data[module_id].imports.size();
+    header.num_import_modules = module.imports.size();
     header.import_modules_ofs = 0; //Will be recalculated later
-    header.ctor_section = modules_data[module_id].ctor_section;
-    header.dtor_section = modules_data[module_id].dtor_section;
-    header.prolog_section = modules_data[module_id].prolog_section;
-    header.prolog_ofs = modules_data[module_id].prolog_addr;
-    header.epilog_section = modules_data[module_id].epilog_section;
-    header.epilog_ofs = modules_data[module_id].epilog_addr;
-    header.unresolved_section = modules_data[module_id].unresolved_section;
-    header.unresolved_ofs = modules_data[module_id].unresolved_addr;
-    WriteHeader(file, &header);
+    header.ctor_section = GetModuleSectionIndex(module.elf_id, module.ctor_section);
+    header.dtor_section = GetModuleSectionIndex(module.elf_id, module.dtor_section);
+    header.prolog_section = GetModuleSectionIndex(module.elf_id, module.prolog_section);
+    header.prolog_ofs = module.prolog_addr;
+    header.epilog_section = GetModuleSectionIndex(module.elf_id, module.epilog_section);
+    header.epilog_ofs = module.epilog_addr;
+    header.unresolved_section = GetModuleSectionIndex(module.elf_id, module.unresolved_section);
+    header.unresolved_ofs = module.unresolved_addr;
+    header.version = module_version;
+    WriteHeader(buf, &header);
 
     //Write section headers
-    uint32_t data_ofs = header.section_info_ofs + (12 * reader->sections.size());
+    uint32_t data_ofs = header.section_info_ofs + (12 * header.num_sections);
     for (uint32_t i = 0; i < reader->sections.size(); i++) {
         ELFIO::Elf_Word type = reader->sections[i]->get_type();
+        if (!IsModuleSectionStored(module.elf_id, i)) {
+            continue;
+        }
+        if (!IsSectionLive(elf_files[module.elf_id], i)) {
+            //Removed sections keep a NULL header in fixed section tables
+            type = ELFIO::SHT_NULL;
+        }
         if (type == ELFIO::SHT_PROGBITS) {
             //Stored section header
             uint32_t align = reader->sections[i]->get_addr_align();
             data_ofs = AlignU32(data_ofs, align);
-            WriteU32(file, data_ofs);
-            WriteU32(file, align);
-            WriteU32(file, reader->sections[i]->get_size());
+            WriteU32(buf, data_ofs);
+            WriteU32(buf, align);
+            WriteU32(buf, reader->sections[i]->get_size());
             data_ofs += reader->sections[i]->get_size();
         }
         else if (type == ELFIO::SHT_NOBITS) {
             //BSS section header
             uint32_t align = reader->sections[i]->get_addr_align();
-            WriteU32(file, 0);
-            WriteU32(file, align);
-            WriteU32(file, reader->sections[i]->get_size());
+            WriteU32(buf, 0);
+            WriteU32(buf, align);
+            WriteU32(buf, reader->sections[i]->get_size());
         }
         else {
             //NULL section header
-            WriteU32(file, 0);
-            WriteU32(file, 0);
-            WriteU32(file, 0);
+            WriteU32(buf, 0);
+            WriteU32(buf, 0);
+            WriteU32(buf, 0);
         }
     }
-    //Write all SHT_PROGBITS sections to file
+    //Write all SHT_PROGBITS sections to module buffer
+    std::vector<uint32_t> section_ofs(reader->sections.size(), 0);
+    uint32_t data_size = 0;
     for (uint32_t i = 0; i < reader->sections.size(); i++) {
-        if (reader->sections[i]->get_type() == ELFIO::SHT_PROGBITS) {
+        if (reader->sections[i]->get_type() == ELFIO::SHT_PROGBITS && IsSectionLive(elf_files[module.elf_id], i)) {
             uint32_t align = reader->sections[i]->get_addr_align();
-            AlignFile(file, align);
-            fwrite(reader->sections[i]->get_data(), 1, reader->sections[i]->get_size(), file);
+            AlignBuffer(buf, align);
+            section_ofs[i] = buf.size();
+            WriteBytes(buf, reader->sections[i]->get_data(), reader->sections[i]->get_size());
+            data_size += reader->sections[i]->get_size();
+        }
+    }
+    //Lay out BSS sections the same way as the loader to get offsets from the BSS base
+    std::vector<uint32_t> image_ofs = section_ofs;
+    uint32_t bss_ofs = 0;
+    for (uint32_t i = 0; i < reader->sections.size(); i++) {
+        ELFIO::section* section = reader->sections[i];
+        if (section->get_type() == ELFIO::SHT_NOBITS && IsModuleSectionStored(module.elf_id, i) && IsSectionLive(elf_files[module.elf_id], i) && section->get_size() != 0) {
+            bss_ofs = AlignU32(bss_ofs, section->get_addr_align());
+            image_ofs[i] = bss_ofs;
+            bss_ofs += section->get_size();
         }
     }
     //Align to 4 bytes for relocation data
-    AlignFile(file, 4);
+    AlignBuffer(buf, 4);
     header.import_modules_ofs = AlignU32(data_ofs, 4);
+    //Encode import relocation lists
+    std::vector<std::vector<uint8_t>> reloc_data;
+    std::vector<uint32_t> reloc_counts;
+    std::map<uint32_t, std::vector<RelocRecord>>::const_iterator iter;
+    for (iter = module.imports.begin(); iter != module.imports.end(); ++iter) {
+        reloc_data.emplace_back();
+        if (module_version == MODULE_VERSION_FIXED_RELOCS) {
+            reloc_counts.push_back(EncodeFixedRelocs(reloc_data.back(), iter->second));
+        }
+        else if (iter->first == module.elf_id) {
+            reloc_counts.push_back(EncodeSelfRelocs(reloc_data.back(), module, image_ofs, iter->second));
+        }
+        else {
+            reloc_counts.push_back(EncodeCompactRelocs(reloc_data.back(), module, iter->first, iter->second));
+        }
+    }
     //Write import relocation lists
     uint32_t reloc_ofs = header.import_modules_ofs + (12 * header.num_import_modules);
-    std::map<uint32_t, std::vector<RelocRecord>>::iterator iter;
-    for (iter = modules_data[module_id].imports.begin(); iter != modules_data[module_id].imports.end(); ++iter) {
-        WriteU32(file, iter->first);
-        WriteU32(file, iter->second.size());
-        WriteU32(file, reloc_ofs);
-        reloc_ofs += iter->second.size() * 12;
+    uint32_t import_idx = 0;
+    for (iter = module.imports.begin(); iter != module.imports.end(); ++iter) {
+        WriteU32(buf, iter->first);
+        WriteU32(buf, reloc_counts[import_idx]);
+        WriteU32(buf, reloc_ofs);
+        reloc_ofs += reloc_data[import_idx].size();
+        import_idx++;
     }
     //Write import relocations
-    for (iter = modules_data[module_id].imports.begin(); iter != modules_data[module_id].imports.end(); ++iter) {
-        for (uint32_t i = 0; i < iter->second.size(); i++) {
-            WriteU32(file, iter->second[i].offset);
-            WriteU8(file, iter->second[i].type);
-            WriteU8(file, 0);
-            WriteU16(file, iter->second[i].section);
-            WriteU32(file, iter->second[i].sym_ofs);
+    for (uint32_t i = 0; i < reloc_data.size(); i++) {
+        WriteBytes(buf, reloc_data[i].data(), reloc_data[i].size());
+    }
+    //Pad to cache line so loads never need the bounce buffer
+    AlignBuffer(buf, 16);
+    //Apply build time relocations once the BSS base of prelinked modules is known
+    std::vector<RelocRecord> static_relocs = module.static_relocs;
+    if (module_version == MODULE_VERSION_COMPACT_RELOCS) {
+        //Self relocations only need the module or BSS base added at load time
+        uint32_t prelink_addr = GetPrelinkAddress(module_id);
+        uint32_t prelink_bss = 0;
+        if (prelink_addr != 0) {
+            prelink_bss = prelink_addr + AlignU32(buf.size(), GetNoloadAlign(module_id));
         }
+        AddSelfStaticRelocs(module, image_ofs, prelink_addr, prelink_bss, static_relocs);
     }
+    ApplyStaticRelocs(buf, module, static_relocs, section_ofs);
     //Rewrite header
-    modules_data[module_id].total_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    WriteHeader(file, &header);
-    fclose(file);
+    modules_data[module_id].total_size = buf.size();
+    std::vector<uint8_t> header_buf;
+    WriteHeader(header_buf, &header);
+    std::copy(header_buf.begin(), header_buf.end(), buf.begin());
+    if (collect_module_stats) {
+        //Account for every byte of the module for reports
+        ModuleStats& stats = modules_data[module_id].stats;
+        stats.header_size = sizeof(ModuleHeader) + (12 * header.num_sections);
+        stats.data_size = data_size;
+        stats.reloc_size = reloc_ofs - header.import_modules_ofs;
+        stats.padding_size = buf.size() - stats.header_size - stats.data_size - stats.reloc_size;
+        import_idx = 0;
+        for (iter = module.imports.begin(); iter != module.imports.end(); ++iter) {
+            stats.target_relocs[iter->first] += reloc_counts[import_idx++];
+            for (const RelocRecord& reloc : iter->second) {
+                if (reloc.type != R_ULTRA_SEC) {
+                    stats.type_relocs[reloc.type]++;
+                }
+            }
+        }
+        if (!module.static_relocs.empty()) {
+            stats.target_relocs[0] += module.static_relocs.size();
+        }
+        for (const RelocRecord& reloc : module.static_relocs) {
+            stats.type_relocs[reloc.type]++;
+        }
+    }
+}
+
+void WriteSharedModule(uint32_t module_id)
+{
+    std::vector<uint8_t>& buf = modules_data[module_id].blob;
+    ModuleHeader header;
+    //Fixed section tables start with a NULL section like ELF files
+    uint32_t first_section = (module_version == MODULE_VERSION_FIXED_RELOCS) ? 1 : 0;
+
+    //Write initial header
+    header.num_sections = first_section + shared_sections.size();
+    header.section_info_ofs = sizeof(ModuleHeader);
+    header.num_import_modules = 0;
+    header.import_modules_ofs = 0; //Will be recalculated later
+    header.ctor_section = ELFIO::SHN_UNDEF;
+    header.dtor_section = ELFIO::SHN_UNDEF;
+    header.prolog_section = ELFIO::SHN_UNDEF;
+    header.prolog_ofs = 0;
+    header.epilog_section = ELFIO::SHN_UNDEF;
+    header.epilog_ofs = 0;
+    header.unresolved_section = ELFIO::SHN_UNDEF;
+    header.unresolved_ofs = 0;
+    header.version = module_version;
+    WriteHeader(buf, &header);
+
+    //Write section headers
+    if (first_section) {
+        WriteU32(buf, 0);
+        WriteU32(buf, 0);
+        WriteU32(buf, 0);
+    }
+    uint32_t data_ofs = header.section_info_ofs + (12 * header.num_sections);
+    for (const SharedSection& shared : shared_sections) {
+        ELFIO::section* section = elf_files[shared.elf_id].reader->sections[shared.section];
+        data_ofs = AlignU32(data_ofs, section->get_addr_align());
+        WriteU32(buf, data_ofs);
+        WriteU32(buf, section->get_addr_align());
+        WriteU32(buf, section->get_size());
+        data_ofs += section->get_size();
+    }
+    //Write one copy of every shared section with main executable relocations applied
+    for (const SharedSection& shared : shared_sections) {
+        const ELFFile& file = elf_files[shared.elf_id];
+        ELFIO::section* section = file.reader->sections[shared.section];
+        std::vector<uint32_t> section_ofs(file.reader->sections.size(), 0);
+        std::vector<RelocRecord> relocs;
+        ModuleData source;
+        source.elf_id = shared.elf_id;
+        AlignBuffer(buf, section->get_addr_align());
+        section_ofs[shared.section] = buf.size();
+        WriteBytes(buf, section->get_data(), section->get_size());
+        GetMainRelocs(file, shared.section, relocs);
+        ApplyStaticRelocs(buf, source, relocs, section_ofs);
+        if (collect_module_stats) {
+            ModuleStats& stats = modules_data[module_id].stats;
+            stats.target_relocs[0] += relocs.size();
+            for (const RelocRecord& reloc : relocs) {
+                stats.type_relocs[reloc.type]++;
+            }
+        }
+    }
+    AlignBuffer(buf, 4);
+    header.import_modules_ofs = buf.size();
+    //Pad to cache line so loads never need the bounce buffer
+    AlignBuffer(buf, 16);
+    //Rewrite header
+    modules_data[module_id].total_size = buf.size();
+    std::vector<uint8_t> header_buf;
+    WriteHeader(header_buf, &header);
+    std::copy(header_buf.begin(), header_buf.end(), buf.begin());
+    if (collect_module_stats) {
+        ModuleStats& stats = modules_data[module_id].stats;
+        stats.header_size = sizeof(ModuleHeader) + (12 * header.num_sections);
+        stats.data_size = 0;
+        for (const SharedSection& shared : shared_sections) {
+            stats.data_size += elf_files[shared.elf_id].reader->sections[shared.section]->get_size();
+        }
+        stats.reloc_size = 0;
+        stats.padding_size = buf.size() - stats.header_size - stats.data_size;
+    }
+}
+
+uint32_t HashName(const std::string& name)
+{
+    //32-bit FNV-1a, must match ModuleFind and ModuleGetSymbol
+    uint32_t hash = 0x811C9DC5;
+    for (char c : name) {
+        hash ^= (uint8_t)c;
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+void WriteExportTable(uint32_t module_id)
+{
+    ModuleData& module = modules_data[module_id];
+    const ELFFile& file = elf_files[module.elf_id];
+    std::vector<ExportSlot> exports;
+    std::vector<uint8_t> strings;
+    for (uint32_t i = 0; i < file.symbols.size(); i++) {
+        const ELFSymbol& symbol = file.symbols[i];
+        //Only the first non-local definition of each name is exported
+        auto iter = file.exports.find(symbol.name);
+        if (iter == file.exports.end() || iter->second != i || IsModuleLocalSymbol(symbol.name) || symbol.section >= ELFIO::SHN_LORESERVE) {
+            continue;
+        }
+        ExportSlot slot;
+        ELFIO::Elf_Word type = file.reader->sections[symbol.section]->get_type();
+        uint16_t shared_section = GetSharedSection(file, symbol.section);
+        if (shared_section != ELFIO::SHN_UNDEF) {
+            //Hoisted symbols live in the shared module
+            slot.module_id = shared_module_id;
+            slot.section = shared_section;
+        }
+        else if ((type == ELFIO::SHT_PROGBITS || type == ELFIO::SHT_NOBITS) && IsSectionLive(file, symbol.section)) {
+            slot.module_id = 0;
+            slot.section = GetModuleSectionIndex(module.elf_id, symbol.section);
+        }
+        else {
+            //Symbol is not loaded with the module
+            continue;
+        }
+        slot.hash = HashName(symbol.name);
+        slot.name_ofs = strings.size();
+        slot.offset = symbol.addr;
+        exports.push_back(slot);
+        WriteBytes(strings, symbol.name.c_str(), symbol.name.length() + 1);
+    }
+    module.export_table.clear();
+    if (exports.empty()) {
+        return;
+    }
+    //Open addressing table at most half full so every probe ends at an empty slot
+    uint32_t num_slots = 2;
+    while (num_slots < exports.size() * 2) {
+        num_slots *= 2;
+    }
+    uint32_t strings_ofs = EXPORT_HEADER_SIZE + (num_slots * EXPORT_SLOT_SIZE);
+    std::vector<ExportSlot> slots(num_slots);
+    for (const ExportSlot& slot : exports) {
+        uint32_t index = slot.hash & (num_slots - 1);
+        while (slots[index].name_ofs != 0) {
+            index = (index + 1) & (num_slots - 1);
+        }
+        slots[index] = slot;
+        slots[index].name_ofs += strings_ofs;
+    }
+    WriteU32(module.export_table, num_slots);
+    WriteU32(module.export_table, exports.size());
+    for (const ExportSlot& slot : slots) {
+        WriteU32(module.export_table, slot.hash);
+        WriteU32(module.export_table, slot.name_ofs);
+        WriteU32(module.export_table, slot.offset);
+        WriteU16(module.export_table, slot.section);
+        WriteU16(module.export_table, slot.module_id);
+    }
+    WriteBytes(module.export_table, strings.data(), strings.size());
+    //Cache line padding lets the table be read with a direct DMA
+    AlignBuffer(module.export_table, 16);
 }
 
-void DeleteTempModules()
+uint32_t GetDependencyListSize()
 {
+    uint32_t size = 0;
     for (uint32_t i = 0; i < modules_data.size(); i++) {
-        std::filesystem::remove(GetModulePath(i));
+        size += modules_data[i].deps.size() * 2;
+    }
+    return size;
+}
+
+uint32_t GetNameTableSlots()
+{
+    //Open addressing table at most half full like export tables
+    uint32_t num_slots = 2;
+    while (num_slots < modules_data.size() * 2) {
+        num_slots *= 2;
     }
+    return num_slots;
+}
+
+uint32_t GetNameTableSize()
+{
+    return NAME_TABLE_HEADER_SIZE + (GetNameTableSlots() * NAME_TABLE_SLOT_SIZE);
 }
 
 uint32_t GetStringTableSize()
 {
-    uint32_t size = 0;
+    //Name table and dependency lists are stored before the strings
+    uint32_t size = GetNameTableSize() + GetDependencyListSize();
     //Accumulate all string lengths
     for (uint32_t i = 0; i < modules_data.size(); i++) {
         size += modules_data[i].name.length() + 1;
     }
-    //Align it to 2 bytes
-    return AlignU32(size, 2);
+    //Pad so module data after the header, handles and strings starts on a cache line
+    uint32_t header_size = 8 + (MODULE_HANDLE_SIZE * modules_data.size());
+    return AlignU32(header_size + size, 16) - header_size;
 }
 
 uint32_t GetModuleAlign(uint32_t module_id)
 {
+    if (IsSharedModule(modules_data[module_id].elf_id)) {
+        uint32_t alignment = 4;
+        for (const SharedSection& shared : shared_sections) {
+            alignment = std::max<uint32_t>(alignment, elf_files[shared.elf_id].reader->sections[shared.section]->get_addr_align());
+        }
+        return alignment;
+    }
     ELFIO::elfio* reader = elf_files[modules_data[module_id].elf_id].reader;
     uint32_t alignment = 4; //Minimum module alignment is 4
     //Calculate maximum alignment of SHT_PROGBITS sections
     for (uint32_t i = 0; i < reader->sections.size(); i++) {
-        if (reader->sections[i]->get_type() == ELFIO::SHT_PROGBITS) {
+        if (reader->sections[i]->get_type() == ELFIO::SHT_PROGBITS && IsSectionLive(elf_files[modules_data[module_id].elf_id], i)) {
             if (reader->sections[i]->get_addr_align() > alignment) {
                 alignment = reader->sections[i]->get_addr_align();
             }
@@ -517,11 +1832,15 @@ uint32_t GetModuleAlign(uint32_t module_id)
 
 uint32_t GetNoloadAlign(uint32_t module_id)
 {
+    if (IsSharedModule(modules_data[module_id].elf_id)) {
+        //Shared module has no BSS
+        return 1;
+    }
     ELFIO::elfio* reader = elf_files[modules_data[module_id].elf_id].reader;
     uint32_t alignment = 1;
     //Calculate maximum alignment of SHT_NOBITS sections
     for (uint32_t i = 0; i < reader->sections.size(); i++) {
-        if (reader->sections[i]->get_type() == ELFIO::SHT_NOBITS) {
+        if (reader->sections[i]->get_type() == ELFIO::SHT_NOBITS && IsSectionLive(elf_files[modules_data[module_id].elf_id], i)) {
             if (reader->sections[i]->get_addr_align() > alignment) {
                 alignment = reader->sections[i]->get_addr_align();
             }
@@ -532,10 +1851,13 @@ uint32_t GetNoloadAlign(uint32_t module_id)
 
 uint32_t GetNoloadSize(uint32_t module_id)
 {
+    if (IsSharedModule(modules_data[module_id].elf_id)) {
+        return 0;
+    }
     ELFIO::elfio* reader = elf_files[modules_data[module_id].elf_id].reader;
     uint32_t size = 0;
     for (uint32_t i = 0; i < reader->sections.size(); i++) {
-        if (reader->sections[i]->get_type() == ELFIO::SHT_NOBITS) {
+        if (reader->sections[i]->get_type() == ELFIO::SHT_NOBITS && IsSectionLive(elf_files[modules_data[module_id].elf_id], i)) {
             //Align size to start at section alignment
             size = AlignU32(size, reader->sections[i]->get_addr_align());
             //Add size to section alignment
@@ -545,72 +1867,1112 @@ uint32_t GetNoloadSize(uint32_t module_id)
     return size;
 }
 
-void WriteOutput(std::string name)
+bool WriteBuffers(FILE* file, const std::vector<const std::vector<uint8_t>*>& buffers)
 {
-    //Open output file
-    FILE* file = fopen(name.c_str(), "wb");
-    if (!file) {
-        std::cout << "Failed to open file " << name << " for writing" << std::endl;
-        DeleteTempModules();
-        DeleteELFReaders();
-        TerminateProgram();
-    }
-    //Write header of output
-    WriteU32(file, modules_data.size());
-    WriteU32(file, GetStringTableSize());
-    //Write module information
-    uint32_t string_ofs = 32 * modules_data.size();
-    uint32_t data_ofs = string_ofs + GetStringTableSize();
-    for (uint32_t i = 0; i < modules_data.size(); i++) {
-        WriteU32(file, string_ofs);
-        WriteU32(file, GetModuleAlign(i));
-        WriteU32(file, modules_data[i].total_size);
-        WriteU32(file, data_ofs);
-        WriteU32(file, GetNoloadAlign(i));
-        WriteU32(file, GetNoloadSize(i));
-        WriteU32(file, 0);
-        WriteU32(file, 0);
-        data_ofs += modules_data[i].total_size;
-        string_ofs += modules_data[i].name.length() + 1;
+#ifdef _WIN32
+    //Fall back to one write per buffer
+    for (size_t i = 0; i < buffers.size(); i++) {
+        if (fwrite(buffers[i]->data(), 1, buffers[i]->size(), file) != buffers[i]->size()) {
+            return false;
+        }
     }
-    //Write strings
-    for (uint32_t i = 0; i < modules_data.size(); i++) {
-        fwrite(modules_data[i].name.c_str(), 1, modules_data[i].name.length() + 1, file);
+    return true;
+#else
+    std::vector<struct iovec> iov;
+    for (size_t i = 0; i < buffers.size(); i++) {
+        if (!buffers[i]->empty()) {
+            struct iovec vec;
+            vec.iov_base = (void*)buffers[i]->data();
+            vec.iov_len = buffers[i]->size();
+            iov.push_back(vec);
+        }
     }
-    //Align to 2 bytes for ROM
-    AlignFile(file, 2);
-    //Write module files
+    //Submit buffers in batches of at most IOV_MAX, retrying short writes
+    size_t pos = 0;
+    while (pos < iov.size()) {
+        int count = std::min<size_t>(iov.size() - pos, IOV_MAX);
+        ssize_t written = writev(fileno(file), &iov[pos], count);
+        if (written < 0) {
+            return false;
+        }
+        while (pos < iov.size() && (size_t)written >= iov[pos].iov_len) {
+            written -= iov[pos].iov_len;
+            pos++;
+        }
+        if (written > 0) {
+            iov[pos].iov_base = (uint8_t*)iov[pos].iov_base + written;
+            iov[pos].iov_len -= written;
+        }
+    }
+    return true;
+#endif
+}
+
+void WriteLZLength(std::vector<uint8_t>& buf, uint32_t length)
+{
+    //Lengths past the token nibble continue in bytes until one is below 255
+    while (length >= 255) {
+        buf.push_back(255);
+        length -= 255;
+    }
+    buf.push_back(length);
+}
+
+void WriteLZSequence(std::vector<uint8_t>& buf, const uint8_t* literals, uint32_t num_literals, uint32_t match_ofs, uint32_t match_len)
+{
+    uint32_t match_code = match_len ? match_len - LZ_MIN_MATCH : 0;
+    buf.push_back((std::min<uint32_t>(num_literals, 15) << 4) | std::min<uint32_t>(match_code, 15));
+    if (num_literals >= 15) {
+        WriteLZLength(buf, num_literals - 15);
+    }
+    WriteBytes(buf, literals, num_literals);
+    if (match_len == 0) {
+        //Final sequence has no match
+        return;
+    }
+    WriteU16(buf, match_ofs);
+    if (match_code >= 15) {
+        WriteLZLength(buf, match_code - 15);
+    }
+}
+
+uint32_t GetLZHash(const uint8_t* data)
+{
+    uint32_t value = (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+    return (value * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+void LZCompress(const std::vector<uint8_t>& src, std::vector<uint8_t>& dst)
+{
+    std::vector<int32_t> head(1 << LZ_HASH_BITS, -1);
+    std::vector<int32_t> prev(src.size(), -1);
+    uint32_t literal_start = 0;
+    uint32_t pos = 0;
+    dst.clear();
+    auto insert_hash = [&](uint32_t ofs) {
+        if (ofs + LZ_MIN_MATCH <= src.size()) {
+            uint32_t hash = GetLZHash(&src[ofs]);
+            prev[ofs] = head[hash];
+            head[hash] = ofs;
+        }
+    };
+    while (pos < src.size()) {
+        //Find longest match in hash chain
+        uint32_t best_len = 0;
+        uint32_t best_ofs = 0;
+        if (pos + LZ_MIN_MATCH <= src.size()) {
+            int32_t candidate = head[GetLZHash(&src[pos])];
+            for (uint32_t i = 0; i < LZ_MAX_CHAIN && candidate >= 0 && pos - candidate <= LZ_MAX_OFFSET; i++) {
+                uint32_t len = 0;
+                while (pos + len < src.size() && src[candidate + len] == src[pos + len]) {
+                    len++;
+                }
+                if (len > best_len) {
+                    best_len = len;
+                    best_ofs = pos - candidate;
+                }
+                candidate = prev[candidate];
+            }
+        }
+        if (best_len < LZ_MIN_MATCH) {
+            insert_hash(pos++);
+            continue;
+        }
+        WriteLZSequence(dst, &src[literal_start], pos - literal_start, best_ofs, best_len);
+        for (uint32_t i = 0; i < best_len; i++) {
+            insert_hash(pos + i);
+        }
+        pos += best_len;
+        literal_start = pos;
+    }
+    if (literal_start < src.size()) {
+        WriteLZSequence(dst, &src[literal_start], src.size() - literal_start, 0, 0);
+    }
+}
+
+bool ReadLZLength(const std::vector<uint8_t>& src, size_t& pos, uint32_t& length)
+{
+    uint8_t value;
+    do {
+        if (pos >= src.size()) {
+            return false;
+        }
+        value = src[pos++];
+        length += value;
+    } while (value == 255);
+    return true;
+}
+
+bool LZDecompress(const std::vector<uint8_t>& src, std::vector<uint8_t>& dst, uint32_t size)
+{
+    //Mirrors the loader's decoder with bounds checks
+    size_t pos = 0;
+    dst.clear();
+    dst.reserve(size);
+    while (dst.size() < size) {
+        if (pos >= src.size()) {
+            return false;
+        }
+        uint8_t token = src[pos++];
+        uint32_t num_literals = token >> 4;
+        if (num_literals == 15 && !ReadLZLength(src, pos, num_literals)) {
+            return false;
+        }
+        if (num_literals > src.size() - pos || num_literals > size - dst.size()) {
+            return false;
+        }
+        dst.insert(dst.end(), src.begin() + pos, src.begin() + pos + num_literals);
+        pos += num_literals;
+        if (dst.size() >= size) {
+            break;
+        }
+        if (src.size() - pos < 2) {
+            return false;
+        }
+        uint32_t match_ofs = (src[pos] << 8) | src[pos + 1];
+        pos += 2;
+        uint32_t match_len = token & 0xF;
+        if (match_len == 15 && !ReadLZLength(src, pos, match_len)) {
+            return false;
+        }
+        match_len += LZ_MIN_MATCH;
+        if (match_ofs == 0 || match_ofs > dst.size() || match_len > size - dst.size()) {
+            return false;
+        }
+        for (uint32_t i = 0; i < match_len; i++) {
+            dst.push_back(dst[dst.size() - match_ofs]);
+        }
+    }
+    return pos == src.size();
+}
+
+void CompressModule(uint32_t module_id)
+{
+    ModuleData& module = modules_data[module_id];
+    LZCompress(module.blob, module.rom_data);
+    //Round trip every module so a codec bug can never reach the ROM
+    std::vector<uint8_t> check;
+    if (!LZDecompress(module.rom_data, check, module.blob.size()) || check != module.blob) {
+        std::cout << "Compression round trip failed for module " << module.name << "." << std::endl;
+        TerminateProgram();
+    }
+    //Trailing padding is never read by the decoder
+    AlignBuffer(module.rom_data, 16);
+    //Store raw when compression does not help
+    if (module.rom_data.size() >= module.blob.size()) {
+        module.rom_data.clear();
+    }
+}
+
+const std::vector<uint8_t>& GetModuleRomData(uint32_t module_id)
+{
+    const ModuleData& module = modules_data[module_id];
+    if (module.rom_data.empty()) {
+        return module.blob;
+    }
+    return module.rom_data;
+}
+
+void PrintCompressionReport()
+{
+    uint64_t total_raw = 0;
+    uint64_t total_rom = 0;
+    std::cout << std::fixed << std::setprecision(1);
+    for (uint32_t i = 0; i < modules_data.size(); i++) {
+        const ModuleData& module = modules_data[i];
+        uint32_t rom_size = GetModuleRomData(i).size();
+        std::cout << module.name << ": " << module.blob.size() << " -> " << rom_size << " bytes (";
+        std::cout << (100.0 * rom_size / std::max<size_t>(module.blob.size(), 1)) << "%)";
+        if (module.rom_data.empty()) {
+            std::cout << ", stored raw";
+        }
+        std::cout << std::endl;
+        total_raw += module.blob.size();
+        total_rom += rom_size;
+    }
+    std::cout << "Total: " << total_raw << " -> " << total_rom << " bytes (";
+    std::cout << (100.0 * total_rom / std::max<uint64_t>(total_raw, 1)) << "%)" << std::endl;
+    std::cout << std::defaultfloat;
+}
+
+const char* GetRelocTypeName(uint8_t type)
+{
+    switch (type) {
+        case R_MIPS_32:
+            return "R_MIPS_32";
+
+        case R_MIPS_26:
+            return "R_MIPS_26";
+
+        case R_MIPS_HI16:
+            return "R_MIPS_HI16";
+
+        case R_MIPS_LO16:
+            return "R_MIPS_LO16";
+
+        default:
+            return "unknown";
+    }
+}
+
+std::string GetModuleIDName(uint32_t id)
+{
+    //Module ID 0 is the main executable
+    if (id == 0) {
+        return "main";
+    }
+    return modules_data[id - 1].name;
+}
+
+std::string QuoteJSON(const std::string& str)
+{
+    std::string quoted = "\"";
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        }
+        else if ((unsigned char)c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            quoted += escape;
+        }
+        else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+uint32_t GetModuleRamSize(uint32_t module_id)
+{
+    //Same size the loader allocates
+    return AlignU32(modules_data[module_id].total_size, GetNoloadAlign(module_id)) + GetNoloadSize(module_id);
+}
+
+uint32_t GetModuleLoadRelocs(uint32_t module_id)
+{
+    //Main executable relocations are applied at build time
+    uint32_t count = 0;
+    for (const std::pair<const uint32_t, uint32_t>& target : modules_data[module_id].stats.target_relocs) {
+        if (target.first != 0) {
+            count += target.second;
+        }
+    }
+    return count;
+}
+
+std::vector<std::pair<std::string, uint32_t>> GetTopSymbols(const std::unordered_map<std::string, uint32_t>& counts)
+{
+    std::vector<std::pair<std::string, uint32_t>> symbols(counts.begin(), counts.end());
+    //Most referenced first, ties by name so reports are stable
+    std::sort(symbols.begin(), symbols.end(), [](const std::pair<std::string, uint32_t>& a, const std::pair<std::string, uint32_t>& b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    });
+    if (symbols.size() > REPORT_TOP_SYMBOLS) {
+        symbols.resize(REPORT_TOP_SYMBOLS);
+    }
+    return symbols;
+}
+
+void WriteJSONSymbols(std::ostringstream& json, const char* name, const std::unordered_map<std::string, uint32_t>& counts)
+{
+    std::vector<std::pair<std::string, uint32_t>> symbols = GetTopSymbols(counts);
+    json << "      " << QuoteJSON(name) << ": [";
+    for (size_t i = 0; i < symbols.size(); i++) {
+        json << (i ? ", " : "") << "{ \"symbol\": " << QuoteJSON(symbols[i].first) << ", \"relocs\": " << symbols[i].second << " }";
+    }
+    json << "]";
+}
+
+void WriteModuleSections(std::ostringstream& json, uint32_t module_id)
+{
+    const ModuleData& module = modules_data[module_id];
+    bool first = true;
+    json << "      \"sections\": [";
+    auto write_section = [&](const ELFIO::section* section, const std::string& name) {
+        const char* type = section->get_type() == ELFIO::SHT_NOBITS ? "nobits" : "progbits";
+        json << (first ? "\n" : ",\n") << "        { \"name\": " << QuoteJSON(name) << ", \"type\": \"" << type << "\", ";
+        json << "\"size\": " << section->get_size() << ", \"align\": " << section->get_addr_align() << " }";
+        first = false;
+    };
+    if (IsSharedModule(module.elf_id)) {
+        //Name shared sections after the module their copy came from
+        for (const SharedSection& shared : shared_sections) {
+            const ELFFile& file = elf_files[shared.elf_id];
+            write_section(file.reader->sections[shared.section], file.name + ":" + file.reader->sections[shared.section]->get_name());
+        }
+    }
+    else {
+        const ELFFile& file = elf_files[module.elf_id];
+        for (uint32_t i = 0; i < file.reader->sections.size(); i++) {
+            ELFIO::section* section = file.reader->sections[i];
+            ELFIO::Elf_Word type = section->get_type();
+            if ((type == ELFIO::SHT_PROGBITS || type == ELFIO::SHT_NOBITS) && IsSectionLive(file, i) && section->get_size() != 0) {
+                write_section(section, section->get_name());
+            }
+        }
+    }
+    json << (first ? "]" : "\n      ]");
+}
+
+void WriteModuleReport(const std::string& path)
+{
+    //Inbound relocations of every module's exported symbols
+    std::vector<std::unordered_map<std::string, uint32_t>> exports(modules_data.size() + 1);
+    for (const ModuleData& module : modules_data) {
+        for (const std::pair<const std::string, uint32_t>& symbol : module.stats.symbol_imports) {
+            const SymbolSearchResult& def = global_symbols[symbol.first].def;
+            uint32_t def_module = def.module;
+            if (GetSharedSection(elf_files[def_module], def.section) != ELFIO::SHN_UNDEF) {
+                def_module = shared_module_id;
+            }
+            exports[def_module][symbol.first] += symbol.second;
+        }
+    }
+    std::ostringstream json;
+    std::ostringstream text;
+    json << "{\n  \"modules\": [\n";
+    text << std::left << std::setw(20) << "Module" << std::right;
+    text << std::setw(10) << "ROM" << std::setw(10) << "RAM" << std::setw(10) << "Data" << std::setw(10) << "BSS";
+    text << std::setw(10) << "Relocs" << std::setw(12) << "Reloc bytes" << std::setw(10) << "Padding" << std::endl;
+    uint64_t totals[7] = {};
+    for (uint32_t i = 0; i < modules_data.size(); i++) {
+        const ModuleData& module = modules_data[i];
+        const ModuleStats& stats = module.stats;
+        uint32_t values[7] = { (uint32_t)GetModuleRomData(i).size(), GetModuleRamSize(i), stats.data_size, GetNoloadSize(i),
+            GetModuleLoadRelocs(i), stats.reloc_size, stats.padding_size };
+        json << "    {\n      \"name\": " << QuoteJSON(module.name) << ",\n      \"id\": " << (i + 1) << ",\n";
+        json << "      \"rom_size\": " << values[0] << ",\n      \"ram_size\": " << values[1] << ",\n";
+        json << "      \"header_size\": " << stats.header_size << ",\n      \"data_size\": " << values[2] << ",\n";
+        json << "      \"bss_size\": " << values[3] << ",\n      \"reloc_size\": " << values[5] << ",\n";
+        json << "      \"padding_size\": " << values[6] << ",\n";
+        json << "      \"export_table_size\": " << module.export_table.size() << ",\n";
+        WriteModuleSections(json, i);
+        json << ",\n      \"relocs\": " << values[4] << ",\n      \"build_time_relocs\": ";
+        json << (stats.target_relocs.count(0) ? stats.target_relocs.at(0) : 0) << ",\n      \"relocs_by_type\": {";
+        bool first = true;
+        for (const std::pair<const uint8_t, uint32_t>& type : stats.type_relocs) {
+            json << (first ? " " : ", ") << QuoteJSON(GetRelocTypeName(type.first)) << ": " << type.second;
+            first = false;
+        }
+        json << (first ? "" : " ") << "},\n      \"relocs_by_target\": {";
+        first = true;
+        for (const std::pair<const uint32_t, uint32_t>& target : stats.target_relocs) {
+            json << (first ? " " : ", ") << QuoteJSON(GetModuleIDName(target.first)) << ": " << target.second;
+            first = false;
+        }
+        json << (first ? "" : " ") << "},\n";
+        WriteJSONSymbols(json, "top_imports", stats.symbol_imports);
+        json << ",\n";
+        WriteJSONSymbols(json, "top_exports", exports[i + 1]);
+        json << "\n    }" << (i + 1 < modules_data.size() ? "," : "") << "\n";
+        text << std::left << std::setw(20) << module.name << std::right;
+        for (uint32_t j = 0; j < 7; j++) {
+            text << std::setw(j == 5 ? 12 : 10) << values[j];
+            totals[j] += values[j];
+        }
+        text << std::endl;
+    }
+    json << "  ],\n  \"main\": {\n";
+    WriteJSONSymbols(json, "top_exports", exports[0]);
+    json << "\n  }\n}\n";
+    text << std::left << std::setw(20) << "Total" << std::right;
+    for (uint32_t j = 0; j < 7; j++) {
+        text << std::setw(j == 5 ? 12 : 10) << totals[j];
+    }
+    text << std::endl;
+    //Write JSON for tools and text summary for people
+    std::string outputs[2] = { json.str(), text.str() };
+    const char* extensions[2] = { ".json", ".txt" };
+    for (uint32_t i = 0; i < 2; i++) {
+        std::string name = path + extensions[i];
+        FILE* file = fopen(name.c_str(), "wb");
+        if (!file || fwrite(outputs[i].data(), 1, outputs[i].size(), file) != outputs[i].size()) {
+            std::cout << "Failed to write report " << name << "." << std::endl;
+            if (file) {
+                fclose(file);
+            }
+            TerminateProgram();
+        }
+        fclose(file);
+    }
+}
+
+void ReadBudgetFile(const std::string& path)
+{
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) {
+        std::cout << "Failed to open budget file " << path << "." << std::endl;
+        TerminateProgram();
+    }
+    char line[1024];
+    uint32_t line_num = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_num++;
+        //Lines are a module name or * followed by limit=value fields, # starts a comment
+        std::string text = line;
+        std::istringstream fields(text.substr(0, text.find('#')));
+        std::string name;
+        std::string field;
+        if (!(fields >> name)) {
+            continue;
+        }
+        ModuleBudget budget = { UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX };
+        while (fields >> field) {
+            size_t equals = field.find('=');
+            char* end = NULL;
+            uint32_t value = 0;
+            if (equals != std::string::npos) {
+                value = strtoul(field.c_str() + equals + 1, &end, 0);
+                if (*end == 'K' || *end == 'k') {
+                    value *= 1024;
+                    end++;
+                }
+            }
+            std::string limit = field.substr(0, equals);
+            uint32_t* budget_value = NULL;
+            if (limit == "ram") {
+                budget_value = &budget.ram;
+            }
+            else if (limit == "rom") {
+                budget_value = &budget.rom;
+            }
+            else if (limit == "relocs") {
+                budget_value = &budget.relocs;
+            }
+            else if (limit == "reloc_bytes") {
+                budget_value = &budget.reloc_bytes;
+            }
+            if (!budget_value || !end || end == field.c_str() + equals + 1 || *end != '\0') {
+                std::cout << path << ":" << line_num << ": invalid budget " << field << "." << std::endl;
+                fclose(file);
+                TerminateProgram();
+            }
+            *budget_value = value;
+        }
+        module_budgets[name] = budget;
+    }
+    fclose(file);
+}
+
+bool CheckBudgetLimit(const std::string& name, const char* limit, uint32_t value, uint32_t budget)
+{
+    if (value <= budget) {
+        return true;
+    }
+    std::cout << name << ": " << limit << " of " << value << " exceeds budget of " << budget << "." << std::endl;
+    return false;
+}
+
+bool CheckModuleBudgets()
+{
+    bool within_budget = true;
+    for (uint32_t i = 0; i < modules_data.size(); i++) {
+        const ModuleData& module = modules_data[i];
+        auto iter = module_budgets.find(module.name);
+        if (iter == module_budgets.end()) {
+            iter = module_budgets.find("*");
+            if (iter == module_budgets.end()) {
+                continue;
+            }
+        }
+        const ModuleBudget& budget = iter->second;
+        within_budget &= CheckBudgetLimit(module.name, "RAM size", GetModuleRamSize(i), budget.ram);
+        within_budget &= CheckBudgetLimit(module.name, "ROM size", GetModuleRomData(i).size(), budget.rom);
+        within_budget &= CheckBudgetLimit(module.name, "relocation count", GetModuleLoadRelocs(i), budget.relocs);
+        within_budget &= CheckBudgetLimit(module.name, "relocation size", module.stats.reloc_size, budget.reloc_bytes);
+    }
+    return within_budget;
+}
+
+uint32_t GetSharedModuleDependency(uint32_t module_id)
+{
+    uint32_t elf_id = modules_data[module_id].elf_id;
+    //Loader loads the shared module before any module using it
+    if (IsSharedModule(elf_id) || !elf_files[elf_id].uses_shared_module) {
+        return 0;
+    }
+    return shared_module_id;
+}
+
+void ReadModuleDependencies(uint32_t module_id)
+{
+    //Read import module IDs back from the blob so cached modules get the same list
+    ModuleData& module = modules_data[module_id];
+    uint32_t num_imports = GetBufferU32(&module.blob[8]);
+    uint32_t imports_ofs = GetBufferU32(&module.blob[12]);
+    module.deps.clear();
+    for (uint32_t i = 0; i < num_imports; i++) {
+        uint32_t import_id = GetBufferU32(&module.blob[imports_ofs + (i * 12)]);
+        //Main executable and self relocations are not dependencies
+        if (import_id != 0 && import_id != module.elf_id) {
+            module.deps.push_back(import_id);
+        }
+    }
+    if (GetSharedModuleDependency(module_id) != 0) {
+        module.deps.push_back(shared_module_id);
+    }
+    std::sort(module.deps.begin(), module.deps.end());
+    module.deps.erase(std::unique(module.deps.begin(), module.deps.end()), module.deps.end());
+}
+
+void WriteOutput(std::string name)
+{
+    std::vector<uint8_t> header_buf;
+    //Write header of output
+    WriteU32(header_buf, modules_data.size());
+    WriteU32(header_buf, GetStringTableSize());
+    //Write module information
+    uint32_t name_table_ofs = MODULE_HANDLE_SIZE * modules_data.size();
+    uint32_t deps_ofs = name_table_ofs + GetNameTableSize();
+    uint32_t string_ofs = deps_ofs + GetDependencyListSize();
+    uint32_t data_ofs = name_table_ofs + GetStringTableSize();
     for (uint32_t i = 0; i < modules_data.size(); i++) {
-        FILE* file2 = fopen(GetModulePath(i).string().c_str(), "rb");
-        uint8_t* temp_buf = new uint8_t[modules_data[i].total_size];
-        fread(temp_buf, 1, modules_data[i].total_size, file2);
-        fwrite(temp_buf, 1, modules_data[i].total_size, file);
-        delete[] temp_buf;
-        fclose(file2);
+        WriteU32(header_buf, string_ofs);
+        WriteU32(header_buf, GetModuleAlign(i));
+        WriteU32(header_buf, modules_data[i].total_size);
+        WriteU32(header_buf, data_ofs);
+        WriteU32(header_buf, GetModuleRomData(i).size());
+        WriteU32(header_buf, GetNoloadAlign(i));
+        WriteU32(header_buf, GetNoloadSize(i));
+        WriteU32(header_buf, GetSharedModuleDependency(i));
+        //Export table follows module data
+        WriteU32(header_buf, data_ofs + GetModuleRomData(i).size());
+        WriteU32(header_buf, modules_data[i].export_table.size());
+        WriteU32(header_buf, GetPrelinkAddress(i));
+        WriteU32(header_buf, deps_ofs);
+        WriteU32(header_buf, modules_data[i].deps.size());
+        //Runtime state cleared by the loader
+        for (uint32_t j = 0; j < 7; j++) {
+            WriteU32(header_buf, 0);
+        }
+        data_ofs += GetModuleRomData(i).size() + modules_data[i].export_table.size();
+        deps_ofs += modules_data[i].deps.size() * 2;
+        string_ofs += modules_data[i].name.length() + 1;
+    }
+    //Write name table so ModuleFind only compares strings on hash matches
+    uint32_t num_slots = GetNameTableSlots();
+    std::vector<uint32_t> slot_hashes(num_slots, 0);
+    std::vector<uint32_t> slot_ids(num_slots, 0);
+    for (uint32_t i = 0; i < modules_data.size(); i++) {
+        uint32_t hash = HashName(modules_data[i].name);
+        uint32_t index = hash & (num_slots - 1);
+        while (slot_ids[index] != 0) {
+            index = (index + 1) & (num_slots - 1);
+        }
+        slot_hashes[index] = hash;
+        slot_ids[index] = i + 1;
+    }
+    WriteU32(header_buf, num_slots);
+    for (uint32_t i = 0; i < num_slots; i++) {
+        WriteU32(header_buf, slot_hashes[i]);
+        WriteU32(header_buf, slot_ids[i]);
+    }
+    //Write dependency lists
+    for (uint32_t i = 0; i < modules_data.size(); i++) {
+        for (uint16_t dep : modules_data[i].deps) {
+            WriteU16(header_buf, dep);
+        }
+    }
+    //Write strings
+    for (uint32_t i = 0; i < modules_data.size(); i++) {
+        WriteBytes(header_buf, modules_data[i].name.c_str(), modules_data[i].name.length() + 1);
+    }
+    //Align to cache line for ROM
+    AlignBuffer(header_buf, 16);
+    //Gather header and module blobs
+    std::vector<const std::vector<uint8_t>*> buffers;
+    buffers.push_back(&header_buf);
+    for (uint32_t i = 0; i < modules_data.size(); i++) {
+        buffers.push_back(&GetModuleRomData(i));
+        buffers.push_back(&modules_data[i].export_table);
+    }
+    //Open output file
+    FILE* file = fopen(name.c_str(), "wb");
+    if (!file) {
+        std::cout << "Failed to open file " << name << " for writing" << std::endl;
+        TerminateProgram();
+    }
+    if (!WriteBuffers(file, buffers)) {
+        std::cout << "Failed to write file " << name << std::endl;
+        fclose(file);
+        TerminateProgram();
     }
     fclose(file);
 }
 
+void WriteModuleIdHeader(const std::string& path, int num_files, char** files)
+{
+    std::ostringstream header;
+    std::unordered_set<std::string> macros;
+    header << "#pragma once\n\n";
+    header << "//Generated by makemodule, do not edit\n";
+    header << "//Module IDs for ModuleLoadId and ModuleGetHandleById in input file order\n";
+    header << "//IDs start at 1 to match the module IDs in the module data, 0 is the main executable\n\n";
+    for (int i = 0; i < num_files; i++) {
+        std::string macro = "MODULE_ID_";
+        for (char c : GetModuleName(files[i])) {
+            macro += isalnum((uint8_t)c) ? toupper((uint8_t)c) : '_';
+        }
+        if (!macros.insert(macro).second) {
+            std::cout << "Module " << files[i] << " maps to already used ID name " << macro << "." << std::endl;
+            TerminateProgram();
+        }
+        header << "#define " << macro << " " << (i + 1) << "\n";
+    }
+    header << "\n#define MODULE_ID_COUNT " << num_files << "\n";
+    //Leave an unchanged header alone so sources including it are not rebuilt
+    std::string contents = header.str();
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file) {
+        std::string old_contents(contents.size() + 1, '\0');
+        size_t old_size = fread(&old_contents[0], 1, old_contents.size(), file);
+        fclose(file);
+        if (old_size == contents.size() && old_contents.compare(0, old_size, contents) == 0) {
+            return;
+        }
+    }
+    file = fopen(path.c_str(), "wb");
+    if (!file || fwrite(contents.data(), 1, contents.size(), file) != contents.size()) {
+        std::cout << "Failed to write module ID header " << path << "." << std::endl;
+        if (file) {
+            fclose(file);
+        }
+        TerminateProgram();
+    }
+    fclose(file);
+}
+
+uint64_t HashBytes(uint64_t hash, const void* data, size_t size)
+{
+    //64-bit FNV-1a
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+uint64_t HashU32(uint64_t hash, uint32_t value)
+{
+    return HashBytes(hash, &value, sizeof(value));
+}
+
+bool GetModuleCacheKey(uint32_t module_id, std::string* key)
+{
+    const ELFFile& file = elf_files[module_id + 1];
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    hash = HashU32(hash, MODULE_CACHE_VERSION);
+    hash = HashU32(hash, module_version);
+    hash = HashU32(hash, module_id + 1);
+    auto prelink_iter = prelink_addrs.find(file.name);
+    hash = HashU32(hash, prelink_iter != prelink_addrs.end() ? prelink_iter->second : 0);
+    //Hash module ELF contents
+    FILE* elf = fopen(file.orig_path.c_str(), "rb");
+    if (!elf) {
+        return false;
+    }
+    uint8_t read_buf[65536];
+    size_t read_size;
+    while ((read_size = fread(read_buf, 1, sizeof(read_buf), elf)) != 0) {
+        hash = HashBytes(hash, read_buf, read_size);
+    }
+    fclose(elf);
+    //Hash which sections survived dead section removal or were hoisted
+    hash = HashU32(hash, shared_module_id);
+    for (uint32_t i = 0; i < file.reader->sections.size(); i++) {
+        hash = HashU32(hash, IsSectionLive(file, i));
+        hash = HashU32(hash, GetSharedSection(file, i));
+    }
+    //Hash every external definition this module resolves against
+    for (uint32_t i = 0; i < file.symbols.size(); i++) {
+        const ELFSymbol& symbol = file.symbols[i];
+        if (symbol.section != ELFIO::SHN_UNDEF || symbol.name.empty()) {
+            continue;
+        }
+        auto iter = global_symbols.find(symbol.name);
+        if (iter == global_symbols.end() || iter->second.duplicate) {
+            //Let import generation report the error
+            return false;
+        }
+        hash = HashBytes(hash, symbol.name.c_str(), symbol.name.length() + 1);
+        hash = HashU32(hash, iter->second.def.module);
+        hash = HashU32(hash, iter->second.def.section);
+        hash = HashU32(hash, GetModuleSectionIndex(iter->second.def.module, iter->second.def.section));
+        hash = HashU32(hash, iter->second.def.addr);
+        hash = HashU32(hash, GetSharedSection(elf_files[iter->second.def.module], iter->second.def.section));
+    }
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+    *key = file.name + "-" + hex + ".rel";
+    return true;
+}
+
+bool ReadCacheFile(const std::string& name, std::vector<uint8_t>& data)
+{
+    FILE* file = fopen((std::filesystem::path(cache_dir) / name).string().c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    data.resize(size);
+    bool success = size > 0 && fread(data.data(), 1, size, file) == (size_t)size;
+    fclose(file);
+    if (!success) {
+        data.clear();
+    }
+    return success;
+}
+
+void WriteCacheFile(const std::string& name, uint32_t module_id, const void* data, size_t size)
+{
+    //Write to unique temporary name and rename so concurrent builds never see partial files
+    std::filesystem::path path = std::filesystem::path(cache_dir) / name;
+    std::filesystem::path temp_path = path;
+    temp_path += "." + std::to_string(getpid()) + "-" + std::to_string(module_id) + ".tmp";
+    FILE* file = fopen(temp_path.string().c_str(), "wb");
+    if (!file) {
+        return;
+    }
+    bool success = fwrite(data, 1, size, file) == size;
+    fclose(file);
+    std::error_code error;
+    if (success) {
+        std::filesystem::rename(temp_path, path, error);
+    }
+    if (!success || error) {
+        std::filesystem::remove(temp_path, error);
+    }
+}
+
+bool ReadModuleStatsCache(uint32_t module_id, const std::string& key)
+{
+    std::vector<uint8_t> data;
+    if (!ReadCacheFile(key + ".stats", data)) {
+        return false;
+    }
+    std::istringstream stream(std::string(data.begin(), data.end()));
+    ModuleStats stats;
+    size_t num_targets, num_types, num_symbols;
+    stream >> stats.header_size >> stats.data_size >> stats.reloc_size >> stats.padding_size;
+    stream >> num_targets >> num_types >> num_symbols;
+    for (size_t i = 0; i < num_targets && stream; i++) {
+        uint32_t target, count;
+        stream >> target >> count;
+        stats.target_relocs[target] = count;
+    }
+    for (size_t i = 0; i < num_types && stream; i++) {
+        uint32_t type, count;
+        stream >> type >> count;
+        stats.type_relocs[type] = count;
+    }
+    for (size_t i = 0; i < num_symbols && stream; i++) {
+        std::string name;
+        uint32_t count;
+        stream >> count >> name;
+        stats.symbol_imports[name] = count;
+    }
+    if (!stream) {
+        return false;
+    }
+    modules_data[module_id].stats = std::move(stats);
+    return true;
+}
+
+void WriteModuleStatsCache(uint32_t module_id, const std::string& key)
+{
+    //Reports and budgets read these so cached modules need not be rebuilt for them
+    const ModuleStats& stats = modules_data[module_id].stats;
+    std::ostringstream stream;
+    stream << stats.header_size << " " << stats.data_size << " " << stats.reloc_size << " " << stats.padding_size << "\n";
+    stream << stats.target_relocs.size() << " " << stats.type_relocs.size() << " " << stats.symbol_imports.size() << "\n";
+    for (const std::pair<const uint32_t, uint32_t>& target : stats.target_relocs) {
+        stream << target.first << " " << target.second << "\n";
+    }
+    for (const std::pair<const uint8_t, uint32_t>& type : stats.type_relocs) {
+        stream << (uint32_t)type.first << " " << type.second << "\n";
+    }
+    for (const std::pair<const std::string, uint32_t>& symbol : stats.symbol_imports) {
+        stream << symbol.second << " " << symbol.first << "\n";
+    }
+    std::string contents = stream.str();
+    WriteCacheFile(key + ".stats", module_id, contents.data(), contents.size());
+}
+
+bool ReadModuleCache(uint32_t module_id, const std::string& key)
+{
+    if (collect_module_stats && !ReadModuleStatsCache(module_id, key)) {
+        return false;
+    }
+    std::vector<uint8_t>& blob = modules_data[module_id].blob;
+    if (!ReadCacheFile(key, blob)) {
+        return false;
+    }
+    modules_data[module_id].total_size = blob.size();
+    return true;
+}
+
+void WriteModuleCache(uint32_t module_id, const std::string& key)
+{
+    const std::vector<uint8_t>& blob = modules_data[module_id].blob;
+    WriteCacheFile(key, module_id, blob.data(), blob.size());
+    if (collect_module_stats) {
+        WriteModuleStatsCache(module_id, key);
+    }
+}
+
+void ProcessModule(uint32_t module_id)
+{
+    std::string key;
+    bool shared = IsSharedModule(module_id + 1);
+    bool cacheable = !shared && !cache_dir.empty() && GetModuleCacheKey(module_id, &key);
+    if (shared) {
+        //Shared module is cheap to rebuild so it is never cached
+        modules_data[module_id].elf_id = module_id + 1;
+        modules_data[module_id].name = SHARED_MODULE_NAME;
+        WriteSharedModule(module_id);
+    }
+    else if (cacheable && ReadModuleCache(module_id, key)) {
+        //Reuse cached module blob
+        modules_data[module_id].elf_id = module_id + 1;
+        modules_data[module_id].name = elf_files[module_id + 1].name;
+    }
+    else {
+        auto start = StartPhase();
+        ReadModule(module_id + 1, module_id);
+        EndPhase(PHASE_READ_MODULE, start);
+        start = StartPhase();
+        WriteModule(module_id);
+        if (cacheable) {
+            WriteModuleCache(module_id, key);
+        }
+        EndPhase(PHASE_WRITE_MODULE, start);
+    }
+    if (compress_modules) {
+        auto start = StartPhase();
+        CompressModule(module_id);
+        EndPhase(PHASE_COMPRESS, start);
+    }
+    if (!shared) {
+        //Export tables are cheap to build so they are never cached
+        auto start = StartPhase();
+        WriteExportTable(module_id);
+        EndPhase(PHASE_EXPORT_TABLE, start);
+    }
+    ReadModuleDependencies(module_id);
+}
+
+void ProcessModuleRange(std::atomic<uint32_t>* next_module)
+{
+    //Claim modules until none are left or another worker failed
+    uint32_t module_id;
+    while (!worker_failed && (module_id = (*next_module)++) < modules_data.size()) {
+        ProcessModule(module_id);
+    }
+}
+
+void ProcessModuleWorker(std::atomic<uint32_t>* next_module)
+{
+    is_worker_thread = true;
+    try {
+        ProcessModuleRange(next_module);
+    }
+    catch (const WorkerTerminated&) {
+        worker_failed = true;
+    }
+}
+
+void ProcessModules(uint32_t num_jobs)
+{
+    std::atomic<uint32_t> next_module(0);
+    modules_data.resize(elf_files.size() - 1);
+    if (shared_module_id != 0) {
+        //Shared module comes after every module ELF
+        modules_data.emplace_back();
+    }
+    if (num_jobs <= 1 || modules_data.size() <= 1) {
+        //Process every module on this thread
+        ProcessModuleRange(&next_module);
+        return;
+    }
+    if (num_jobs > modules_data.size()) {
+        num_jobs = modules_data.size();
+    }
+    //Modules only read shared ELF data so they can be processed in any order
+    std::vector<std::thread> workers;
+    for (uint32_t i = 0; i < num_jobs; i++) {
+        workers.emplace_back(ProcessModuleWorker, &next_module);
+    }
+    for (uint32_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+    if (worker_failed) {
+        //Every worker has finished its current module so cleanup is safe
+        TerminateProgram();
+    }
+}
+
 int main(int argc, char** argv)
 {
-    if (argc < 3) {
-        std::cout << "Usage: " << argv[0] << " out_file input_files" << std::endl;
+    uint32_t num_jobs = 1;
+    int arg_base = 1;
+    std::string budget_path;
+    std::string id_header_path;
+    //Parse options
+    while (arg_base < argc && argv[arg_base][0] == '-') {
+        std::string option = argv[arg_base];
+        if (option == "-j" && arg_base + 1 < argc) {
+            num_jobs = strtoul(argv[arg_base + 1], NULL, 0);
+            if (num_jobs == 0) {
+                num_jobs = std::thread::hardware_concurrency();
+            }
+            arg_base += 2;
+        }
+        else if (option == "-f" && arg_base + 1 < argc) {
+            std::string format = argv[arg_base + 1];
+            if (format == "fixed") {
+                module_version = MODULE_VERSION_FIXED_RELOCS;
+            }
+            else if (format == "compact") {
+                module_version = MODULE_VERSION_COMPACT_RELOCS;
+            }
+            else {
+                std::cout << "Unknown relocation format " << format << "." << std::endl;
+                return 1;
+            }
+            arg_base += 2;
+        }
+        else if (option == "-d") {
+            remove_dead_sections = true;
+            arg_base++;
+        }
+        else if (option == "-s") {
+            share_sections = true;
+            arg_base++;
+        }
+        else if (option == "-z") {
+            compress_modules = true;
+            arg_base++;
+        }
+        else if (option == "-r") {
+            print_compression_report = true;
+            arg_base++;
+        }
+        else if (option == "-m" && arg_base + 1 < argc) {
+            report_path = argv[arg_base + 1];
+            arg_base += 2;
+        }
+        else if (option == "-b" && arg_base + 1 < argc) {
+            budget_path = argv[arg_base + 1];
+            arg_base += 2;
+        }
+        else if (option == "-k" && arg_base + 1 < argc) {
+            ReadKeptSymbols(argv[arg_base + 1]);
+            arg_base += 2;
+        }
+        else if (option == "-p" && arg_base + 1 < argc) {
+            ReadPrelinkFile(argv[arg_base + 1]);
+            arg_base += 2;
+        }
+        else if (option == "-c" && arg_base + 1 < argc) {
+            cache_dir = argv[arg_base + 1];
+            arg_base += 2;
+        }
+        else if (option == "-i" && arg_base + 1 < argc) {
+            id_header_path = argv[arg_base + 1];
+            arg_base += 2;
+        }
+        else if (option == "-t") {
+            print_phase_times = true;
+            arg_base++;
+        }
+        else {
+            std::cout << "Unknown option " << option << "." << std::endl;
+            return 1;
+        }
+    }
+    if (!id_header_path.empty() && argc - arg_base >= 1) {
+        //Only module file names are needed so this runs before any ELF is linked
+        WriteModuleIdHeader(id_header_path, argc - arg_base, &argv[arg_base]);
+        return 0;
+    }
+    if (argc - arg_base < 2) {
+        std::cout << "Usage: " << argv[0] << " -i id_header module_files" << std::endl;
+        std::cout << "Usage: " << argv[0] << " [-j jobs] [-c cache_dir] [-f fixed|compact] [-d] [-k symbol_list] [-s] [-p prelink_file] [-z] [-r] [-m report] [-b budget_file] [-t] out_file input_files" << std::endl;
         std::cout << "First input file must be non-relocatable and have symbols." << std::endl;
         std::cout << "Other input files must be relocatable." << std::endl;
+        std::cout << "-j 0 uses one job per hardware thread." << std::endl;
+        std::cout << "-c reuses module data from cache_dir for unchanged modules." << std::endl;
+        std::cout << "-f selects the relocation format (default compact)." << std::endl;
+        std::cout << "-d removes per-function sections no module entry point can reach." << std::endl;
+        std::cout << "-k keeps sections defining the symbols in symbol_list for ModuleGetSymbol." << std::endl;
+        std::cout << "-s moves read-only sections duplicated across modules into a shared module." << std::endl;
+        std::cout << "-p prelinks modules at the hex addresses listed next to their names in prelink_file." << std::endl;
+        std::cout << "-z compresses modules that get smaller." << std::endl;
+        std::cout << "-r prints compression ratio per module." << std::endl;
+        std::cout << "-m writes module sizes and relocation counts to report.json and report.txt." << std::endl;
+        std::cout << "-b fails when a module exceeds its budget. Each budget_file line is a module name" << std::endl;
+        std::cout << "   or * followed by any of ram=, rom=, relocs= and reloc_bytes= limits." << std::endl;
+        std::cout << "-t prints the time spent in each phase and peak memory use." << std::endl;
+        std::cout << "-i writes a C header of module IDs named after module_files and exits." << std::endl;
         return 1;
     }
-    LoadELF(argv[2], false);
-    for (int i = 0; i < argc - 3; i++) {
-        LoadELF(argv[i + 3], true);
+    collect_module_stats = !report_path.empty() || !budget_path.empty();
+    if (!budget_path.empty()) {
+        ReadBudgetFile(budget_path);
     }
-    for (uint32_t i = 1; i < elf_files.size(); i++) {
-        ReadModule(i);
+    auto start = StartPhase();
+    LoadELF(argv[arg_base + 1], false);
+    for (int i = arg_base + 2; i < argc; i++) {
+        LoadELF(argv[i], true);
     }
-    for (uint32_t i = 0; i < modules_data.size(); i++) {
-        WriteModuleTemp(i);
+    EndPhase(PHASE_LOAD_ELF, start);
+    start = StartPhase();
+    BuildGlobalSymbolIndex();
+    EndPhase(PHASE_SYMBOL_INDEX, start);
+    if (remove_dead_sections) {
+        start = StartPhase();
+        RemoveDeadSections();
+        EndPhase(PHASE_DEAD_SECTIONS, start);
+    }
+    if (share_sections) {
+        start = StartPhase();
+        ShareDuplicateSections();
+        EndPhase(PHASE_SHARE_SECTIONS, start);
+    }
+    if (!cache_dir.empty()) {
+        std::error_code error;
+        std::filesystem::create_directories(cache_dir, error);
+        if (error) {
+            std::cout << "Failed to create cache directory " << cache_dir << "." << std::endl;
+            TerminateProgram();
+        }
+    }
+    start = StartPhase();
+    ProcessModules(num_jobs);
+    EndPhase(PHASE_PROCESS_MODULES, start);
+    start = StartPhase();
+    if (print_compression_report) {
+        PrintCompressionReport();
+    }
+    if (!report_path.empty()) {
+        WriteModuleReport(report_path);
+    }
+    if (!budget_path.empty() && !CheckModuleBudgets()) {
+        std::cout << "Module budget exceeded." << std::endl;
+        TerminateProgram();
+    }
+    EndPhase(PHASE_REPORTS, start);
+    start = StartPhase();
+    WriteOutput(argv[arg_base]);
+    EndPhase(PHASE_WRITE_OUTPUT, start);
+    if (print_phase_times) {
+        PrintPhaseTimes();
     }
-    WriteOutput(argv[1]);
-    DeleteTempModules();
     DeleteELFReaders();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "rom_read.h"
+
+//Checks the loader's LZ decoder in src/rom_read.c against makemodule output using stubbed PI DMA
+
+#define MODULE_HANDLE_SIZE 80
+#define DMA_POISON 0xA5
+#define DST_GUARD_SIZE 64
+
+static u8 *rom_image;
+static u32 rom_image_size;
+static OSPiHandle cart_handle;
+static u32 num_dmas;
+
+void _debug_assert(const char *expression, const char *file, int line)
+{
+    printf("Assertion %s failed in %s line %d.\n", expression, file, line);
+    exit(1);
+}
+
+OSPiHandle *osCartRomInit(void)
+{
+    return &cart_handle;
+}
+
+s32 osEPiStartDma(OSPiHandle *handle, OSIoMesg *mb, s32 direction)
+{
+    OSMesgQueue *mq = mb->hdr.retQueue;
+    if (handle != &cart_handle || direction != OS_READ) {
+        printf("DMA started with invalid handle or direction.\n");
+        exit(1);
+    }
+    if ((mb->devAddr & 0x1) || (mb->size & 0x1) || ((u32)(uintptr_t)mb->dramAddr & 0x7)) {
+        printf("Misaligned DMA of %u bytes from %08X.\n", mb->size, mb->devAddr);
+        exit(1);
+    }
+    if (mb->devAddr > rom_image_size || mb->size > rom_image_size - mb->devAddr) {
+        printf("DMA of %u bytes from %08X reads past end of ROM.\n", mb->size, mb->devAddr);
+        exit(1);
+    }
+    if (mq->dma || mq->valid_count >= mq->msg_count) {
+        printf("DMA started while its return queue is full.\n");
+        exit(1);
+    }
+    //Destination holds garbage until the completion message is received
+    memset(mb->dramAddr, DMA_POISON, mb->size);
+    mq->dma = mb;
+    num_dmas++;
+    return 0;
+}
+
+void osCreateMesgQueue(OSMesgQueue *mq, OSMesg *msg, s32 count)
+{
+    mq->valid_count = 0;
+    mq->msg_count = count;
+    mq->dma = NULL;
+}
+
+s32 osSendMesg(OSMesgQueue *mq, OSMesg msg, s32 flag)
+{
+    if (mq->valid_count >= mq->msg_count) {
+        return -1;
+    }
+    mq->valid_count++;
+    return 0;
+}
+
+s32 osRecvMesg(OSMesgQueue *mq, OSMesg *msg, s32 flag)
+{
+    if (mq->dma) {
+        //Complete DMA in flight
+        memcpy(mq->dma->dramAddr, &rom_image[mq->dma->devAddr], mq->dma->size);
+        mq->dma = NULL;
+        return 0;
+    }
+    if (mq->valid_count == 0) {
+        //Nothing else could ever send this message
+        printf("Receive would block forever.\n");
+        exit(1);
+    }
+    mq->valid_count--;
+    return 0;
+}
+
+OSIntMask osSetIntMask(OSIntMask mask)
+{
+    return OS_IM_NONE;
+}
+
+void osInvalDCache(void *vaddr, s32 nbytes)
+{
+}
+
+void osWritebackDCache(void *vaddr, s32 nbytes)
+{
+}
+
+static u8 *ReadFile(const char *path, u32 *size)
+{
+    FILE *file = fopen(path, "rb");
+    u8 *data;
+    long file_size;
+    if (!file) {
+        printf("Failed to open %s.\n", path);
+        exit(1);
+    }
+    fseek(file, 0, SEEK_END);
+    file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    //Leave room to place the data at an odd offset with padding for rounded up DMAs
+    data = calloc(file_size + 2, 1);
+    if (!data || fread(data + 1, 1, file_size, file) != (size_t)file_size) {
+        printf("Failed to read %s.\n", path);
+        exit(1);
+    }
+    fclose(file);
+    *size = file_size;
+    return data;
+}
+
+static u32 ReadU32(const u8 *data)
+{
+    return (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+static double GetTime(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + (time.tv_nsec / 1000000000.0);
+}
+
+static double TimeDecode(u8 *dst, u32 module_size, u32 rom_ofs, u32 rom_size)
+{
+    //Repeat decoding long enough to time short modules
+    u32 iterations = 0;
+    double start = GetTime();
+    double elapsed;
+    do {
+        RomReadCompressed(dst, module_size, rom_ofs, rom_size);
+        iterations++;
+        elapsed = GetTime() - start;
+    } while (elapsed < 0.01);
+    return module_size * (double)iterations / elapsed / 1000000.0;
+}
+
+int main(int argc, char **argv)
+{
+    u8 *raw_file;
+    u8 *lz_file;
+    u32 raw_size;
+    u32 lz_size;
+    u32 num_modules;
+    u32 num_tested = 0;
+    u32 max_rom_size = 0;
+    if (argc != 3) {
+        printf("Usage: %s raw_modules compressed_modules\n", argv[0]);
+        printf("Decompresses every module of compressed_modules with RomReadCompressed and compares it to raw_modules.\n");
+        return 1;
+    }
+    raw_file = ReadFile(argv[1], &raw_size);
+    lz_file = ReadFile(argv[2], &lz_size);
+    num_modules = ReadU32(&lz_file[1]);
+    if (raw_size < 8 || lz_size < 8 || ReadU32(&raw_file[1]) != num_modules
+        || (uint64_t)num_modules * MODULE_HANDLE_SIZE > lz_size - 8) {
+        printf("Module files do not have matching headers.\n");
+        return 1;
+    }
+    for (u32 i = 0; i < num_modules; i++) {
+        const u8 *raw_handle = &raw_file[1 + 8 + (i * MODULE_HANDLE_SIZE)];
+        const u8 *lz_handle = &lz_file[1 + 8 + (i * MODULE_HANDLE_SIZE)];
+        u32 module_size = ReadU32(&lz_handle[8]);
+        u32 rom_ofs = ReadU32(&lz_handle[12]) + 8;
+        u32 rom_size = ReadU32(&lz_handle[16]);
+        u32 raw_ofs = ReadU32(&raw_handle[12]) + 8;
+        u8 *dst;
+        if (ReadU32(&raw_handle[8]) != module_size || raw_ofs > raw_size || module_size > raw_size - raw_ofs
+            || rom_ofs > lz_size || rom_size > lz_size - rom_ofs) {
+            printf("Module %u has an invalid handle.\n", i);
+            return 1;
+        }
+        if (rom_size >= module_size) {
+            //Stored raw
+            continue;
+        }
+        dst = malloc(module_size + DST_GUARD_SIZE);
+        //Decode from both even and odd ROM offsets
+        for (u32 odd = 0; odd < 2; odd++) {
+            rom_image = odd ? lz_file : lz_file + 1;
+            rom_image_size = lz_size + 1 + odd;
+            memset(dst, DMA_POISON, module_size + DST_GUARD_SIZE);
+            num_dmas = 0;
+            RomReadCompressed(dst, module_size, rom_ofs + odd, rom_size);
+            if (memcmp(dst, &raw_file[1 + raw_ofs], module_size) != 0) {
+                printf("Module %u decoded from %s ROM offset does not match raw data.\n", i, odd ? "odd" : "even");
+                return 1;
+            }
+            for (u32 j = 0; j < DST_GUARD_SIZE; j++) {
+                if (dst[module_size + j] != DMA_POISON) {
+                    printf("Module %u decoder wrote past end of module.\n", i);
+                    return 1;
+                }
+            }
+            if (num_dmas != (rom_size + odd + ROMREAD_LZ_CHUNK_SIZE - 1) / ROMREAD_LZ_CHUNK_SIZE) {
+                printf("Module %u read %u chunks instead of every chunk once.\n", i, num_dmas);
+                return 1;
+            }
+        }
+        //Stub DMA copies make this a relative measure of decoder cost only
+        rom_image = lz_file + 1;
+        rom_image_size = lz_size + 1;
+        printf("%s: %u -> %u bytes (%.1f%%), host decode %.1f MB/s\n", &lz_file[1 + 8 + ReadU32(lz_handle)],
+            module_size, rom_size, 100.0 * rom_size / module_size, TimeDecode(dst, module_size, rom_ofs, rom_size));
+        free(dst);
+        if (rom_size > max_rom_size) {
+            max_rom_size = rom_size;
+        }
+        num_tested++;
+    }
+    if (max_rom_size <= 2 * ROMREAD_LZ_CHUNK_SIZE) {
+        printf("No compressed module is larger than both chunk buffers.\n");
+        return 1;
+    }
+    printf("Decoded %u compressed modules, largest %u bytes.\n", num_tested, max_rom_size);
+    return 0;
+}
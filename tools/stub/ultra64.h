@@ -0,0 +1,57 @@
+#pragma once
+
+//Minimal libultra stand-in so loader code can be built and tested on the host
+
+#include <stddef.h>
+#include <stdint.h>
+#include <strings.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef int32_t s32;
+
+typedef void *OSMesg;
+typedef u32 OSIntMask;
+
+typedef struct OSIoMesg OSIoMesg;
+
+typedef struct OSMesgQueue {
+	s32 valid_count;
+	s32 msg_count;
+	OSIoMesg *dma; //DMA that completes on the next receive
+} OSMesgQueue;
+
+typedef struct {
+	u16 type;
+	u8 pri;
+	u8 status;
+	OSMesgQueue *retQueue;
+} OSIoMesgHdr;
+
+struct OSIoMesg {
+	OSIoMesgHdr hdr;
+	void *dramAddr;
+	u32 devAddr;
+	u32 size;
+};
+
+typedef struct {
+	u32 type;
+} OSPiHandle;
+
+#define OS_MESG_NOBLOCK 0
+#define OS_MESG_BLOCK 1
+#define OS_MESG_PRI_NORMAL 0
+#define OS_READ 0
+#define OS_WRITE 1
+#define OS_IM_NONE 0x1
+
+OSPiHandle *osCartRomInit(void);
+s32 osEPiStartDma(OSPiHandle *handle, OSIoMesg *mb, s32 direction);
+void osCreateMesgQueue(OSMesgQueue *mq, OSMesg *msg, s32 count);
+s32 osSendMesg(OSMesgQueue *mq, OSMesg msg, s32 flag);
+s32 osRecvMesg(OSMesgQueue *mq, OSMesg *msg, s32 flag);
+OSIntMask osSetIntMask(OSIntMask mask);
+void osInvalDCache(void *vaddr, s32 nbytes);
+void osWritebackDCache(void *vaddr, s32 nbytes);